@@ -0,0 +1,151 @@
+#ifndef AFFINITY_H_N8QC2VXM
+#define AFFINITY_H_N8QC2VXM
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include "../kit.h"
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+    #define KIT_AFFINITY 1
+#else
+    #define KIT_AFFINITY 0
+#endif
+
+namespace kit
+{
+    namespace detail
+    {
+        // parses sysfs cpu lists like "0-3,8-11"
+        inline std::vector<unsigned> parse_cpulist(const std::string& s) {
+            std::vector<unsigned> cpus;
+            std::istringstream ss(s);
+            std::string range;
+            while(std::getline(ss, range, ',')) {
+                if(range.empty() || range == "\n")
+                    continue;
+                const size_t dash = range.find('-');
+                const unsigned first = std::strtoul(range.c_str(), nullptr, 10);
+                const unsigned last = dash == std::string::npos ? first :
+                    std::strtoul(range.c_str() + dash + 1, nullptr, 10);
+                for(unsigned c = first; c <= last; ++c)
+                    cpus.push_back(c);
+            }
+            return cpus;
+        }
+
+        inline std::vector<std::vector<unsigned>> read_cpu_nodes() {
+            std::vector<unsigned> allowed;
+#if KIT_AFFINITY
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if(sched_getaffinity(0, sizeof(set), &set) == 0)
+                for(unsigned c = 0; c < CPU_SETSIZE; ++c)
+                    if(CPU_ISSET(c, &set))
+                        allowed.push_back(c);
+#endif
+            if(allowed.empty())
+                for(unsigned c = 0;
+                    c < std::max(1U, boost::thread::hardware_concurrency());
+                    ++c
+                )
+                    allowed.push_back(c);
+
+            std::vector<std::vector<unsigned>> nodes;
+#if KIT_AFFINITY
+            for(unsigned n = 0;; ++n) {
+                std::ifstream f(
+                    "/sys/devices/system/node/node" +
+                    std::to_string(n) + "/cpulist"
+                );
+                if(not f)
+                    break;
+                std::string line;
+                std::getline(f, line);
+                std::vector<unsigned> node;
+                for(unsigned c: parse_cpulist(line))
+                    if(std::find(allowed.begin(), allowed.end(), c) !=
+                        allowed.end()
+                    )
+                        node.push_back(c);
+                if(not node.empty())
+                    nodes.push_back(std::move(node));
+            }
+#endif
+            if(nodes.empty())
+                nodes.push_back(std::move(allowed));
+            return nodes;
+        }
+    }
+
+    /*
+     * The cpus this process may run on, grouped by NUMA node
+     *
+     * Without NUMA information (or off Linux) this is a single node
+     * Read once, the first time it is called, so call it before
+     *   pinning the calling thread
+     */
+    inline const std::vector<std::vector<unsigned>>& cpu_nodes() {
+        static const std::vector<std::vector<unsigned>> nodes =
+            detail::read_cpu_nodes();
+        return nodes;
+    }
+
+    // every cpu in cpu_nodes(), so cpus that are close together in this
+    //   list share a node
+    inline std::vector<unsigned> cpu_order() {
+        std::vector<unsigned> cpus;
+        for(auto&& node: cpu_nodes())
+            cpus.insert(cpus.end(), node.begin(), node.end());
+        return cpus;
+    }
+
+    // the node in cpu_nodes() that cpu belongs to
+    inline const std::vector<unsigned>& cpu_node(unsigned cpu) {
+        for(auto&& node: cpu_nodes())
+            if(std::find(node.begin(), node.end(), cpu) != node.end())
+                return node;
+        return cpu_nodes()[0];
+    }
+
+    /*
+     * Restricts a thread to cpus, or lets it run on any of cpu_order()
+     *   again if cpus is empty
+     *
+     * Returns false if pinning isn't supported or failed
+     */
+    inline bool pin_thread(
+        boost::thread::native_handle_type thread,
+        const std::vector<unsigned>& cpus
+    ) {
+#if KIT_AFFINITY
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(unsigned c: cpus.empty() ? cpu_order() : cpus)
+            if(c < CPU_SETSIZE)
+                CPU_SET(c, &set);
+        return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+        (void)thread;
+        (void)cpus;
+        return false;
+#endif
+    }
+    inline bool pin_this_thread(const std::vector<unsigned>& cpus) {
+#if KIT_AFFINITY
+        return pin_thread(pthread_self(), cpus);
+#else
+        (void)cpus;
+        return false;
+#endif
+    }
+}
+
+#endif
+
@@ -4,6 +4,7 @@
 #include "task.h"
 #include "mx.h"
 #include "channel.h"
+#include "parallel.h"
 
 template<class T>
 class async_wrap
@@ -15,15 +16,15 @@ private:
     
 public:
 
-    async_wrap(Multiplexer::Circuit* circuit = &MX[0]):
+    async_wrap(Multiplexer::Circuit* circuit = &MX.any_circuit()):
         m_pCircuit(circuit),
         m_Data(T())
     {}
-    async_wrap(T&& v, Multiplexer::Circuit* circuit = &MX[0]):
+    async_wrap(T&& v, Multiplexer::Circuit* circuit = &MX.any_circuit()):
         m_pCircuit(circuit),
         m_Data(v)
     {}
-    async_wrap(const T& v, Multiplexer::Circuit* circuit = &MX[0]):
+    async_wrap(const T& v, Multiplexer::Circuit* circuit = &MX.any_circuit()):
         m_pCircuit(circuit),
         m_Data(std::forward(v))
     {}
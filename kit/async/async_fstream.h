@@ -5,18 +5,26 @@
 #include <string>
 #include <future>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
 #include "async.h"
 #include "../kit.h"
 
+/*
+ * An fstream whose operations run in order on MX.blocking() threads,
+ *   driven by coroutines on circuit, so a slow disk doesn't stall the
+ *   other units on that circuit
+ */
 class async_fstream
 {
     public:
 
-        async_fstream(Multiplexer::Circuit* circuit = &MX[0]):
+        async_fstream(Multiplexer::Circuit* circuit = &MX.any_circuit()):
             m_pCircuit(circuit)
         {}
         //async_fstream(
-        //    std::string fn, Multiplexer::Circuit* circuit = &MX[0]
+        //    std::string fn, Multiplexer::Circuit* circuit = &MX.any_circuit()
         //):
         //    m_pCircuit(circuit),
         //    m_Filename(fn)
@@ -38,7 +46,7 @@ class async_fstream
         std::future<void> open(
             std::ios_base::openmode mode = std::ios_base::in|std::ios_base::out
         ){
-            return m_pCircuit->task<void>([this, mode]{
+            return run<void>([this, mode]{
                 m_File.open(m_Filename, mode);
             });
         }
@@ -46,7 +54,7 @@ class async_fstream
             std::string fn,
             std::ios_base::openmode mode = std::ios_base::in|std::ios_base::out
         ){
-            return m_pCircuit->task<void>([this, fn, mode]{
+            return run<void>([this, fn, mode]{
                 _close();
                 m_File.open(fn, mode);
                 m_Filename = fn;
@@ -54,22 +62,22 @@ class async_fstream
         }
 
         std::future<bool> is_open() {
-            return m_pCircuit->task<bool>([this]{
+            return run<bool>([this]{
                 return m_File.is_open();
             });
         }
         std::future<void> close() {
-            return m_pCircuit->task<void>([this]{
+            return run<void>([this]{
                 _close();
             });
         }
         std::future<std::string> filename() const {
-            return m_pCircuit->task<std::string>(
+            return run<std::string>(
                 [this]{return m_Filename;}
             );
         };
         std::future<std::string> buffer() const {
-            return m_pCircuit->task<std::string>([this]{
+            return run<std::string>([this]{
                 _cache();
                 return m_Buffer;
             });
@@ -77,35 +85,91 @@ class async_fstream
 
         template<class T>
         std::future<T> with(std::function<T(std::fstream& f)> func) {
-            return m_pCircuit->task<T>([this,func]{ return func(m_File); });
+            return run<T>([this,func]{ return func(m_File); });
         }
         template<class T>
         std::future<T> with(std::function<T(const std::string&)> func) {
-            return m_pCircuit->task<T>([this,func]{
+            return run<T>([this,func]{
                 _cache();
                 return func(m_Buffer);
             });
         }
 
         std::future<void> invalidate() {
-            return m_pCircuit->task<void>(
+            return run<void>(
                 [this]{_invalidate();}
             );
         }
 
         std::future<void> recache() {
-            return m_pCircuit->task<void>(
+            return run<void>(
                 [this]{_invalidate();_cache();}
             );
         }
         std::future<void> cache() const {
-            return m_pCircuit->task<void>(
+            return run<void>(
                 [this]{_cache();}
             );
         }
 
     private:
 
+        // an operation's place in line, handed on once it's done or
+        //   once its coroutine is dropped without running (cancelled
+        //   TaskGroup, stopped multiplexer), so later ones don't hang
+        struct Ticket
+        {
+            Ticket(const async_fstream* self, size_t number):
+                self(self),
+                number(number)
+            {}
+            ~Ticket() {
+                release();
+            }
+            void release() {
+                if(self) {
+                    self->done(number);
+                    self = nullptr;
+                }
+            }
+            const async_fstream* self;
+            const size_t number;
+        };
+        
+        // runs func on the blocking pool once every operation before it
+        //   is done, from a coroutine parked on circuit in the meantime
+        template<class T>
+        std::future<T> run(std::function<T()> func) const {
+            auto ticket = std::make_shared<Ticket>(this, m_NextTicket++);
+            return m_pCircuit->coro<T>([this, ticket, func]{
+                auto& mx = m_pCircuit->multiplexer();
+                {
+                    auto waiting = mx.waiting(m_Turn);
+                    while(m_Serving != ticket->number)
+                        waiting.next();
+                }
+                struct Next {
+                    Ticket& ticket;
+                    ~Next() {
+                        ticket.release();
+                    }
+                } next{*ticket};
+                return mx.blocking(func);
+            });
+        }
+        
+        // tickets can be done out of order, serving moves past each run
+        //   of them from the front
+        void done(size_t ticket) const {
+            {
+                std::unique_lock<std::mutex> lck(m_TicketMutex);
+                m_DoneTickets.insert(ticket);
+                while(m_DoneTickets.erase(m_Serving))
+                    ++m_Serving;
+            }
+            m_Turn.notify_all();
+        }
+
         void _close() {
             m_Filename = std::string();
             _invalidate();
@@ -133,6 +197,13 @@ class async_fstream
         std::string m_Filename;
 
         mutable std::string m_Buffer;
+
+        // operations go in ticket order, see run()
+        mutable std::atomic<size_t> m_NextTicket = ATOMIC_VAR_INIT(0);
+        mutable std::atomic<size_t> m_Serving = ATOMIC_VAR_INIT(0);
+        mutable std::set<size_t> m_DoneTickets;
+        mutable std::mutex m_TicketMutex;
+        mutable WaitList m_Turn;
 };
 
 #endif
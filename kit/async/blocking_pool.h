@@ -0,0 +1,101 @@
+#ifndef BLOCKING_POOL_H_Q2M8ZR4T
+#define BLOCKING_POOL_H_Q2M8ZR4T
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <boost/thread.hpp>
+#include "../kit.h"
+#include "small_function.h"
+
+namespace kit
+{
+    /*
+     * Threads for jobs that block (file I/O, DNS lookups, ...), so they
+     *   don't hold up the threads running everything else
+     *
+     * Threads are started as jobs come in, while none are idle, up to
+     *   max_threads, after which jobs queue up in order
+     * Destroying the pool runs whatever is still queued first
+     */
+    class blocking_pool
+    {
+        public:
+
+            typedef kit::small_function<void()> Job;
+
+            explicit blocking_pool(unsigned max_threads):
+                m_MaxThreads(std::max(1U, max_threads))
+            {}
+            blocking_pool(const blocking_pool&) = delete;
+            blocking_pool& operator=(const blocking_pool&) = delete;
+            ~blocking_pool() {
+                {
+                    std::unique_lock<std::mutex> l(m_Mutex);
+                    m_bStop = true;
+                }
+                m_Cond.notify_all();
+                for(auto&& t: m_Threads)
+                    t.join();
+            }
+
+            void post(Job job) {
+                {
+                    std::unique_lock<std::mutex> l(m_Mutex);
+                    m_Jobs.push_back(std::move(job));
+                    if(m_Idle == 0 && m_Threads.size() < m_MaxThreads) {
+                        m_Threads.emplace_back([this]{ work(); });
+                        return;
+                    }
+                }
+                m_Cond.notify_one();
+            }
+
+            // threads started so far
+            size_t threads() const {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                return m_Threads.size();
+            }
+            unsigned max_threads() const {
+                return m_MaxThreads;
+            }
+            // jobs that haven't started yet
+            size_t queued() const {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                return m_Jobs.size();
+            }
+
+        private:
+
+            void work() {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                while(true) {
+                    ++m_Idle;
+                    m_Cond.wait(l, [this]{
+                        return m_bStop || not m_Jobs.empty();
+                    });
+                    --m_Idle;
+                    if(m_Jobs.empty())
+                        return; // stopping
+                    Job job = std::move(m_Jobs.front());
+                    m_Jobs.pop_front();
+                    l.unlock();
+                    job();
+                    l.lock();
+                }
+            }
+
+            const unsigned m_MaxThreads;
+            mutable std::mutex m_Mutex;
+            std::condition_variable m_Cond;
+            std::deque<Job> m_Jobs;
+            std::vector<boost::thread> m_Threads;
+            unsigned m_Idle = 0;
+            bool m_bStop = false;
+    };
+}
+
+#endif
+
@@ -10,9 +10,28 @@
 #include <future>
 #include <memory>
 #include <utility>
+#include <boost/optional.hpp>
 #include "../kit.h"
+#include "lockfree.h"
+#include "mx.h"
 #include "task.h"
 
+// default capacity of lock-free channels, see Channel<T, kit::spsc>
+#ifndef CHANNEL_RING_SIZE
+#define CHANNEL_RING_SIZE 1024
+#endif
+
+/*
+ * Values passed between units (or threads), optionally bounded by buffer()
+ *
+ * Operations only try_lock(), yielding (or returning false) instead of
+ *   waiting when the channel is busy, full or empty
+ * Coroutines can park until the channel changes instead of polling it:
+ *   AWAIT_ON(chan.recv_waiters(), chan.get())
+ *   AWAIT_ON(chan.send_waiters(), chan << val)
+ * The channel's own operations wake them, unlocking an explicit lock()
+ *   does not
+ */
 template<class T, class Mutex=std::mutex>
 class Channel:
     public kit::mutexed<Mutex>
@@ -24,18 +43,18 @@ class Channel:
 
         // Put into stream
         void operator<<(T val) {
-            auto l = this->lock(std::defer_lock);
-            if(!l.try_lock())
+            if(not try_send(std::move(val)))
                 throw kit::yield_exception();
-            if(m_bClosed)
-                throw std::runtime_error("channel closed");
-            if(!m_Buffered || m_Vals.size() < m_Buffered)
-            {
-                m_Vals.push_back(std::move(val));
-                m_bNewData = true;
-                return;
-            }
-            throw kit::yield_exception();
+        }
+        
+        // Non-throwing versions of operator<<
+        // returns false if the channel is busy or full,
+        //   val is only moved from on success
+        bool try_send(const T& val) {
+            return _send(val);
+        }
+        bool try_send(T&& val) {
+            return _send(std::move(val));
         }
         template<class Buffer=std::vector<T>>
         void stream(Buffer& vals) {
@@ -49,7 +68,7 @@ class Channel:
             bool partial = false;
             if(m_Buffered)
             {
-                capacity = m_Buffered - m_Vals.size();
+                capacity = m_Buffered - std::min(m_Buffered, pending());
                 if(buflen > capacity)
                 {
                     buflen = capacity;
@@ -58,12 +77,10 @@ class Channel:
             }
             if(buflen)
             {
-                m_Vals.insert(m_Vals.end(),
-                    make_move_iterator(vals.begin()),
-                    make_move_iterator(vals.begin() + buflen)
-                );
-                vals.erase(vals.begin(), vals.begin() + buflen);
-                m_bNewData = true;
+                put(vals, buflen);
+                m_Ready = pending();
+                l.unlock();
+                m_RecvWaiters.notify_all();
                 if(partial)
                     throw kit::yield_exception();
                 return;
@@ -90,44 +107,50 @@ class Channel:
         
         // Get from stream
         void operator>>(T& val) {
-            if(not m_bNewData)
+            if(not try_recv(val))
                 throw kit::yield_exception();
+        }
+        
+        // Non-throwing version of operator>>
+        // returns false if nothing could be received yet
+        bool try_recv(T& val) {
+            if(not m_Ready)
+                return false;
             auto l = this->lock(std::defer_lock);
             if(!l.try_lock())
-                throw kit::yield_exception();
+                return false;
             //if(m_bClosed)
             //    throw std::runtime_error("channel closed");
-            //m_bNewData = false;
-            if(!m_Vals.empty())
+            if(pending())
             {
-                val = std::move(m_Vals.front());
-                m_Vals.pop_front();
-                if(m_Vals.empty())
-                    m_bNewData = false;
-                return;
+                val = std::move(m_Vals[m_Head]);
+                pop();
+                m_Ready = pending();
+                l.unlock();
+                received(1);
+                return true;
             }
-            throw kit::yield_exception();
+            return false;
         }
         void operator>>(std::vector<T>& vals) {
             get(vals);
         }
         template<class Buffer=std::vector<T>>
         void get(Buffer& vals) {
-            if(not m_bNewData)
+            if(not m_Ready)
                 throw kit::yield_exception();
             auto l = this->lock(std::defer_lock);
             if(!l.try_lock())
                 throw kit::yield_exception();
             //if(m_bClosed)
             //    throw std::runtime_error("channel closed");
-            m_bNewData = false;
-            if(!m_Vals.empty())
+            if(pending())
             {
-                vals.insert(vals.end(),
-                    make_move_iterator(m_Vals.begin()),
-                    make_move_iterator(m_Vals.end())
-                );
-                m_Vals.clear();
+                const size_t n = pending();
+                take(vals);
+                m_Ready = 0;
+                l.unlock();
+                received(n);
                 return;
             }
             throw kit::yield_exception();
@@ -140,15 +163,15 @@ class Channel:
         }
 
         T peek() {
-            if(not m_bNewData)
+            if(not m_Ready)
                 throw kit::yield_exception();
             auto l = this->lock(std::defer_lock);
             if(!l.try_lock())
                 throw kit::yield_exception();
             //if(m_bClosed)
             //    throw std::runtime_error("channel closed");
-            if(!m_Vals.empty())
-                return m_Vals.front();
+            if(pending())
+                return m_Vals[m_Head];
             throw kit::yield_exception();
         }
         
@@ -156,88 +179,478 @@ class Channel:
         //       trigger this
         template<class R=std::vector<T>>
         R get_until(T token) {
-            if(not m_bNewData)
+            if(not m_Ready)
                 throw kit::yield_exception();
             auto l = this->lock(std::defer_lock);
             if(!l.try_lock())
                 throw kit::yield_exception();
             //if(m_bClosed)
             //    throw std::runtime_error("channel closed");
-            for(size_t i=0;i<m_Vals.size();++i)
+            for(size_t i=m_Head;i<m_Vals.size();++i)
             {
                 if(m_Vals[i] == token)
                 {
-                    R r(make_move_iterator(m_Vals.begin()),
+                    R r(make_move_iterator(m_Vals.begin() + m_Head),
                         make_move_iterator(m_Vals.begin() + i));
-                    m_Vals.erase(
-                        m_Vals.begin(),
-                        m_Vals.begin() + i + 1
-                    );
+                    const size_t n = i + 1 - m_Head;
+                    pop(n);
+                    m_Ready = pending();
+                    l.unlock();
+                    received(n);
                     return r;
                 }
             }
             throw kit::yield_exception();
         }
         T get() {
-            if(not m_bNewData)
+            auto r = try_get();
+            if(not r)
                 throw kit::yield_exception();
+            return std::move(*r);
+        }
+        
+        // Non-throwing version of get()
+        boost::optional<T> try_get() {
+            if(not m_Ready)
+                return boost::none;
             auto l = this->lock(std::defer_lock);
             if(!l.try_lock())
-                throw kit::yield_exception();
-            m_bNewData = 0;
+                return boost::none;
             //if(m_bClosed)
             //    throw std::runtime_error("channel closed");
-            if(!m_Vals.empty()) {
-                auto r = std::move(m_Vals.front());
-                m_Vals.pop_front();
+            if(pending()) {
+                boost::optional<T> r(std::move(m_Vals[m_Head]));
+                pop();
+                m_Ready = pending();
+                l.unlock();
+                received(1);
                 return r;
             }
-            throw kit::yield_exception();
+            return boost::none;
+        }
+
+        /*
+         * Calls func(first, last) with everything ready in place (as a
+         *   range of T*), then releases it, returns how many values that
+         *   was, or 0 without calling func if there were none
+         *
+         * The values are swapped out under the lock and func runs without
+         *   it, so senders aren't held up in the meantime, and the storage
+         *   is handed back for reuse afterwards
+         * The values are released even if func throws
+         */
+        template<class Func>
+        size_t try_consume(Func func) {
+            if(not m_Ready)
+                return 0;
+            std::vector<T> batch;
+            size_t head;
+            {
+                auto l = this->lock(std::defer_lock);
+                if(!l.try_lock())
+                    return 0;
+                if(not pending())
+                    return 0;
+                head = m_Head;
+                batch.swap(m_Vals);
+                m_Head = 0;
+                m_Ready = 0;
+            }
+            const size_t n = batch.size() - head;
+            received(n);
+            func(batch.data() + head, batch.data() + batch.size());
+            batch.clear();
+            recycle(batch);
+            return n;
+        }
+        // throwing version of try_consume()
+        template<class Func>
+        size_t consume(Func func) {
+            const size_t n = try_consume(std::move(func));
+            if(not n)
+                throw kit::yield_exception();
+            return n;
         }
 
         //operator bool() const {
         //    return m_bClosed;
         //}
         bool ready() const {
-            return m_bNewData;
+            return m_Ready != 0;
+        }
+        // values waiting to be received, without locking
+        size_t ready_count() const {
+            return m_Ready;
         }
         bool empty() const {
             auto l = this->lock();
-            return m_Vals.empty();
+            return not pending();
         }
         size_t size() const {
             auto l = this->lock();
-            return m_Vals.size();
+            return pending();
         }
         size_t buffered() const {
             auto l = this->lock();
             return m_Buffered;
         }
         void unbuffer() {
-            auto l = this->lock();
-            m_Buffered = 0;
+            {
+                auto l = this->lock();
+                m_Buffered = 0;
+            }
+            m_SendWaiters.notify_all();
         }
         void buffer(size_t sz) {
-            auto l = this->lock();
-            //if(sz > m_Buffered)
-            //    m_Vals.reserve(sz);
-            m_Buffered = sz;
+            {
+                auto l = this->lock();
+                //if(sz > m_Buffered)
+                //    m_Vals.reserve(sz);
+                m_Buffered = sz;
+            }
+            m_SendWaiters.notify_all();
         }
         void close() {
             // atomic
             m_bClosed = true;
+            m_RecvWaiters.notify_all();
+            m_SendWaiters.notify_all();
         }
         bool closed() const {
             // atomic
             return m_bClosed;
         }
 
+        // coroutines waiting for something to receive
+        WaitList& recv_waiters() {
+            return m_RecvWaiters;
+        }
+        // coroutines waiting for room to send (when buffered)
+        WaitList& send_waiters() {
+            return m_SendWaiters;
+        }
+
     private:
         
+        template<class V>
+        bool _send(V&& val) {
+            auto l = this->lock(std::defer_lock);
+            if(!l.try_lock())
+                return false;
+            if(m_bClosed)
+                throw std::runtime_error("channel closed");
+            if(!m_Buffered || pending() < m_Buffered)
+            {
+                compact();
+                m_Vals.push_back(std::forward<V>(val));
+                m_Ready = pending();
+                l.unlock();
+                m_RecvWaiters.notify_one();
+                return true;
+            }
+            return false;
+        }
+
+        // after n values were taken, called without the lock
+        void received(size_t n) {
+            // another receiver may have lost the race for the lock,
+            //   so pass the wakeup on while there's still something left
+            if(m_Ready)
+                m_RecvWaiters.notify_one();
+            if(n == 1)
+                m_SendWaiters.notify_one();
+            else
+                m_SendWaiters.notify_all();
+        }
+        
+        // the rest of this is called with the lock held
+
+        size_t pending() const {
+            return m_Vals.size() - m_Head;
+        }
+        // drops n received values from the front
+        void pop(size_t n = 1) {
+            m_Head += n;
+            if(m_Head == m_Vals.size()) {
+                m_Vals.clear();
+                m_Head = 0;
+            }
+        }
+        // erases received values once they're most of m_Vals, so
+        //   appending stays amortized O(1)
+        void compact() {
+            if(m_Head && m_Head >= m_Vals.size() / 2) {
+                m_Vals.erase(m_Vals.begin(), m_Vals.begin() + m_Head);
+                m_Head = 0;
+            }
+        }
+
+        // moves the first n of vals to the back
+        template<class Buffer>
+        void put(Buffer& vals, size_t n) {
+            compact();
+            m_Vals.insert(m_Vals.end(),
+                make_move_iterator(vals.begin()),
+                make_move_iterator(vals.begin() + n)
+            );
+            vals.erase(vals.begin(), vals.begin() + n);
+        }
+        // takes the whole vector when nothing is pending, leaving vals
+        //   with our old (empty) storage to reuse
+        void put(std::vector<T>& vals, size_t n) {
+            if(n == vals.size() && not pending()) {
+                m_Vals.clear();
+                m_Head = 0;
+                m_Vals.swap(vals);
+                return;
+            }
+            put<std::vector<T>>(vals, n);
+        }
+
+        // moves everything pending to the back of vals
+        template<class Buffer>
+        void take(Buffer& vals) {
+            vals.insert(vals.end(),
+                make_move_iterator(m_Vals.begin() + m_Head),
+                make_move_iterator(m_Vals.end())
+            );
+            m_Vals.clear();
+            m_Head = 0;
+        }
+        // swaps storage with an empty vector instead of moving
+        void take(std::vector<T>& vals) {
+            if(vals.empty() && not m_Head) {
+                m_Vals.swap(vals);
+                return;
+            }
+            take<std::vector<T>>(vals);
+        }
+
+        // gives an emptied batch from try_consume() back, if we can use it
+        void recycle(std::vector<T>& batch) {
+            auto l = this->lock(std::defer_lock);
+            if(!l.try_lock())
+                return;
+            if(m_Vals.empty() && m_Vals.capacity() < batch.capacity())
+                m_Vals.swap(batch);
+        }
+        
         size_t m_Buffered = 0;
-        std::deque<T> m_Vals;
+        // values before m_Head were already received, see pop()
+        std::vector<T> m_Vals;
+        size_t m_Head = 0;
         std::atomic<bool> m_bClosed = ATOMIC_VAR_INIT(false);
-        std::atomic<bool> m_bNewData = ATOMIC_VAR_INIT(false);
+        // pending(), updated under the lock but readable without it
+        std::atomic<size_t> m_Ready = ATOMIC_VAR_INIT(0);
+        WaitList m_RecvWaiters;
+        WaitList m_SendWaiters;
+};
+
+namespace kit
+{
+    // pass as Channel's second parameter instead of a mutex to get a
+    //   bounded lock-free channel:
+    //     Channel<T, kit::spsc>: one producer and one consumer at a time
+    //     Channel<T, kit::mpsc>: any number of producers, one consumer
+    struct spsc {};
+    struct mpsc {};
+
+    namespace detail
+    {
+        /*
+         * Channel surface over a lock-free ring
+         *
+         * Nothing here locks, so operations only yield when the ring is
+         *   actually full (or empty), never because the other side is busy
+         * The capacity is fixed when constructed (rounded up to a power of
+         *   two), so there is no buffer()/unbuffer() or lock(), and no
+         *   get_until(), which would need to search the ring
+         * recv_waiters() and send_waiters() work like Channel's, and cost
+         *   nothing while nobody is parked on them
+         */
+        template<class T, class Ring>
+        class ring_channel
+        {
+            public:
+
+                explicit ring_channel(size_t capacity = CHANNEL_RING_SIZE):
+                    m_Ring(capacity)
+                {}
+                virtual ~ring_channel() {}
+
+                // producer side
+
+                void operator<<(T val) {
+                    if(not try_send(std::move(val)))
+                        throw kit::yield_exception();
+                }
+                // returns false if the channel is full,
+                //   val is only moved from on success
+                bool try_send(const T& val) {
+                    check_open();
+                    if(not m_Ring.push(val))
+                        return false;
+                    m_RecvWaiters.notify_one();
+                    return true;
+                }
+                bool try_send(T&& val) {
+                    check_open();
+                    if(not m_Ring.push(std::move(val)))
+                        return false;
+                    m_RecvWaiters.notify_one();
+                    return true;
+                }
+                // sends as much of vals as fits, see Channel::stream()
+                template<class Buffer=std::vector<T>>
+                void stream(Buffer& vals) {
+                    check_open();
+                    const size_t n = m_Ring.push(
+                        std::make_move_iterator(vals.begin()),
+                        std::make_move_iterator(vals.end())
+                    );
+                    const bool partial = n < vals.size();
+                    vals.erase(vals.begin(), vals.begin() + n);
+                    if(n)
+                        m_RecvWaiters.notify_all();
+                    if(not n || partial)
+                        throw kit::yield_exception();
+                }
+                void operator<<(std::vector<T>& vals) {
+                    stream(vals);
+                }
+
+                // consumer side
+
+                void operator>>(T& val) {
+                    if(not try_recv(val))
+                        throw kit::yield_exception();
+                }
+                bool try_recv(T& val) {
+                    if(not m_Ring.pop(val))
+                        return false;
+                    m_SendWaiters.notify_one();
+                    return true;
+                }
+                void operator>>(std::vector<T>& vals) {
+                    get(vals);
+                }
+                // appends everything received so far to vals
+                template<class Buffer=std::vector<T>>
+                void get(Buffer& vals) {
+                    consume([&vals](T* first, T* last) {
+                        vals.insert(vals.end(),
+                            std::make_move_iterator(first),
+                            std::make_move_iterator(last)
+                        );
+                    });
+                }
+                template<class Buffer=std::vector<T>>
+                Buffer get() {
+                    Buffer buf;
+                    get(buf);
+                    return buf;
+                }
+                T peek() {
+                    T* p = m_Ring.front();
+                    if(not p)
+                        throw kit::yield_exception();
+                    return *p;
+                }
+                T get() {
+                    auto r = try_get();
+                    if(not r)
+                        throw kit::yield_exception();
+                    return std::move(*r);
+                }
+                boost::optional<T> try_get() {
+                    T* p = m_Ring.front();
+                    if(not p)
+                        return boost::none;
+                    boost::optional<T> r(std::move(*p));
+                    m_Ring.pop();
+                    m_SendWaiters.notify_one();
+                    return r;
+                }
+                // see Channel::try_consume(), func reads the values in
+                //   place in the ring, so it may be called more than once
+                //   with consecutive ranges
+                template<class Func>
+                size_t try_consume(Func func) {
+                    const size_t n = m_Ring.consume(std::move(func));
+                    if(n)
+                        m_SendWaiters.notify_all();
+                    return n;
+                }
+                template<class Func>
+                size_t consume(Func func) {
+                    const size_t n = try_consume(std::move(func));
+                    if(not n)
+                        throw kit::yield_exception();
+                    return n;
+                }
+
+                // sizes are only hints outside of the consumer
+                bool ready() const {
+                    return not m_Ring.empty();
+                }
+                bool empty() const {
+                    return m_Ring.empty();
+                }
+                size_t size() const {
+                    return m_Ring.size();
+                }
+                size_t buffered() const {
+                    return m_Ring.capacity();
+                }
+                void close() {
+                    m_bClosed = true;
+                    m_RecvWaiters.notify_all();
+                    m_SendWaiters.notify_all();
+                }
+                bool closed() const {
+                    return m_bClosed;
+                }
+
+                WaitList& recv_waiters() {
+                    return m_RecvWaiters;
+                }
+                WaitList& send_waiters() {
+                    return m_SendWaiters;
+                }
+
+            private:
+
+                void check_open() const {
+                    if(m_bClosed)
+                        throw std::runtime_error("channel closed");
+                }
+
+                Ring m_Ring;
+                std::atomic<bool> m_bClosed = ATOMIC_VAR_INIT(false);
+                WaitList m_RecvWaiters;
+                WaitList m_SendWaiters;
+        };
+    }
+}
+
+template<class T>
+class Channel<T, kit::spsc>:
+    public kit::detail::ring_channel<T, kit::spsc_ring<T>>
+{
+    public:
+        explicit Channel(size_t capacity = CHANNEL_RING_SIZE):
+            kit::detail::ring_channel<T, kit::spsc_ring<T>>(capacity)
+        {}
+};
+
+template<class T>
+class Channel<T, kit::mpsc>:
+    public kit::detail::ring_channel<T, kit::mpsc_ring<T>>
+{
+    public:
+        explicit Channel(size_t capacity = CHANNEL_RING_SIZE):
+            kit::detail::ring_channel<T, kit::mpsc_ring<T>>(capacity)
+        {}
 };
 
 #endif
@@ -0,0 +1,418 @@
+#ifndef FUTURE_H_R6MUQ2ZD
+#define FUTURE_H_R6MUQ2ZD
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/optional.hpp>
+#include <boost/coroutine/exceptions.hpp>
+#include "../kit.h"
+
+namespace kit
+{
+    template<class T> class future;
+    template<class T> class promise;
+
+    namespace detail
+    {
+        // holds the result, void has nothing to hold
+        template<class T>
+        struct future_value
+        {
+            template<class V>
+            void set(V&& v) {
+                value = std::forward<V>(v);
+            }
+            T take() {
+                return std::move(*value);
+            }
+            boost::optional<T> value;
+        };
+        template<>
+        struct future_value<void>
+        {
+            void set() {}
+            void take() {}
+        };
+
+        template<class T>
+        struct future_state:
+            public future_value<T>
+        {
+            // calls cb once ready (right away if it already is),
+            //   from whichever thread completes the future
+            void on_ready(std::function<void()> cb) {
+                std::unique_lock<std::mutex> l(mutex);
+                if(not ready) {
+                    callbacks.push_back(std::move(cb));
+                    return;
+                }
+                l.unlock();
+                cb();
+            }
+            // callbacks run outside the lock, in the completing thread
+            void complete(std::unique_lock<std::mutex>& l) {
+                ready = true;
+                std::vector<std::function<void()>> cbs;
+                cbs.swap(callbacks);
+                l.unlock();
+                cond.notify_all();
+                for(auto&& cb: cbs)
+                    cb();
+            }
+
+            std::mutex mutex;
+            std::condition_variable cond;
+            bool ready = false;
+            std::exception_ptr error;
+            std::vector<std::function<void()>> callbacks;
+        };
+
+        // completes p (a promise<R>) with the result of func(args...),
+        //   letting kit::yield_exception through so the caller can retry
+        //   (and forced_unwind, so destroyed coroutines can unwind)
+        // Promise is a parameter since promise isn't complete yet here
+        template<class R>
+        struct invoke
+        {
+            template<class Promise, class Func, class ...Args>
+            static void attempt(Promise& p, Func& func, Args&&... args) {
+                try{
+                    p.set_value(func(std::forward<Args>(args)...));
+                }catch(const kit::yield_exception&){
+                    throw;
+                }catch(const boost::coroutines::detail::forced_unwind&){
+                    throw;
+                }catch(...){
+                    p.set_exception(std::current_exception());
+                }
+            }
+        };
+        template<>
+        struct invoke<void>
+        {
+            template<class Promise, class Func, class ...Args>
+            static void attempt(Promise& p, Func& func, Args&&... args) {
+                try{
+                    func(std::forward<Args>(args)...);
+                    p.set_value();
+                }catch(const kit::yield_exception&){
+                    throw;
+                }catch(const boost::coroutines::detail::forced_unwind&){
+                    throw;
+                }catch(...){
+                    p.set_exception(std::current_exception());
+                }
+            }
+        };
+
+        // passes a ready state's value (or error) on to a continuation
+        template<class T>
+        struct chain
+        {
+            template<class Func>
+            struct result {
+                typedef decltype(std::declval<Func&>()(std::declval<T>())) type;
+            };
+            template<class R, class Func>
+            static void run(future_state<T>& s, promise<R>& p, Func& func) {
+                if(s.error) {
+                    p.set_exception(s.error);
+                    return;
+                }
+                try{
+                    invoke<R>::attempt(p, func, s.take());
+                }catch(const kit::yield_exception&){
+                    p.set_exception(std::current_exception());
+                }
+            }
+        };
+        template<>
+        struct chain<void>
+        {
+            template<class Func>
+            struct result {
+                typedef decltype(std::declval<Func&>()()) type;
+            };
+            template<class R, class Func>
+            static void run(future_state<void>& s, promise<R>& p, Func& func) {
+                if(s.error) {
+                    p.set_exception(s.error);
+                    return;
+                }
+                try{
+                    invoke<R>::attempt(p, func);
+                }catch(const kit::yield_exception&){
+                    p.set_exception(std::current_exception());
+                }
+            }
+        };
+    }
+
+    /*
+     * Like std::promise, but its future can have continuations
+     * Destroying an unfulfilled promise breaks it (std::future_error)
+     * Only the first set_value() or set_exception() counts, so several
+     *   threads may race to fulfill it
+     */
+    template<class T>
+    class promise
+    {
+        public:
+
+            promise():
+                m_pState(std::make_shared<detail::future_state<T>>())
+            {}
+            promise(promise&&) = default;
+            promise& operator=(promise&&) = default;
+            promise(const promise&) = delete;
+            promise& operator=(const promise&) = delete;
+            ~promise() {
+                if(m_pState && m_bRetrieved)
+                    set_exception(std::make_exception_ptr(
+                        std::future_error(std::future_errc::broken_promise)
+                    ));
+            }
+
+            future<T> get_future() {
+                m_bRetrieved = true;
+                return future<T>(m_pState);
+            }
+
+            // value only for non-void T
+            template<class ...V>
+            void set_value(V&&... v) {
+                std::unique_lock<std::mutex> l(m_pState->mutex);
+                if(m_pState->ready)
+                    return;
+                m_pState->set(std::forward<V>(v)...);
+                m_pState->complete(l);
+            }
+            void set_exception(std::exception_ptr e) {
+                std::unique_lock<std::mutex> l(m_pState->mutex);
+                if(m_pState->ready)
+                    return;
+                m_pState->error = e;
+                m_pState->complete(l);
+            }
+
+        private:
+
+            std::shared_ptr<detail::future_state<T>> m_pState;
+            bool m_bRetrieved = false;
+    };
+
+    /*
+     * Like std::future, plus continuations with then() that run as
+     *   soon as the value is ready, instead of polling for it
+     *
+     * then(func) calls func(value) (or func() for void) and returns a
+     *   future of its result, errors skip func and are passed along
+     * then(circuit, func) runs func as a task on that circuit instead
+     *   of in the thread that fulfilled the promise
+     *
+     * get() and then() consume the future
+     */
+    template<class T>
+    class future
+    {
+        public:
+
+            future() = default;
+            explicit future(std::shared_ptr<detail::future_state<T>> state):
+                m_pState(std::move(state))
+            {}
+            future(future&&) = default;
+            future& operator=(future&&) = default;
+            future(const future&) = delete;
+            future& operator=(const future&) = delete;
+
+            bool valid() const {
+                return bool(m_pState);
+            }
+            bool ready() const {
+                std::unique_lock<std::mutex> l(m_pState->mutex);
+                return m_pState->ready;
+            }
+            void wait() const {
+                std::unique_lock<std::mutex> l(m_pState->mutex);
+                m_pState->cond.wait(l, [this]{ return m_pState->ready; });
+            }
+            template<class Duration>
+            bool wait_for(Duration d) const {
+                std::unique_lock<std::mutex> l(m_pState->mutex);
+                return m_pState->cond.wait_for(l, d, [this]{
+                    return m_pState->ready;
+                });
+            }
+
+            // blocks until ready, rethrows the error if there was one
+            T get() {
+                wait();
+                auto state = std::move(m_pState);
+                if(state->error)
+                    std::rethrow_exception(state->error);
+                return state->take();
+            }
+
+            template<class Func>
+            future<typename detail::chain<T>::template result<Func>::type>
+            then(Func func) {
+                typedef typename detail::chain<T>::template result<Func>::type R;
+                auto p = std::make_shared<promise<R>>();
+                auto fut = p->get_future();
+                auto state = std::move(m_pState);
+                auto s = state.get();
+                s->on_ready([state, p, func]() mutable {
+                    detail::chain<T>::run(*state, *p, func);
+                });
+                return fut;
+            }
+            // Executor is anything with post(func), like Multiplexer::Circuit
+            template<class Executor, class Func>
+            future<typename detail::chain<T>::template result<Func>::type>
+            then(Executor& ex, Func func) {
+                typedef typename detail::chain<T>::template result<Func>::type R;
+                auto p = std::make_shared<promise<R>>();
+                auto fut = p->get_future();
+                auto state = std::move(m_pState);
+                auto s = state.get();
+                Executor* exp = &ex;
+                s->on_ready([exp, state, p, func]() {
+                    exp->post([state, p, func]() mutable {
+                        detail::chain<T>::run(*state, *p, func);
+                    });
+                });
+                return fut;
+            }
+
+        private:
+
+            template<class U> friend class future;
+            template<class U>
+            friend future<size_t> when_any(std::vector<future<U>>& futs);
+            template<class U>
+            friend typename std::enable_if<not std::is_void<U>::value,
+                future<std::vector<U>>>::type
+            when_all(std::vector<future<U>> futs);
+            friend future<void> when_all(std::vector<future<void>> futs);
+
+            std::shared_ptr<detail::future_state<T>> m_pState;
+    };
+
+    template<class T>
+    future<typename std::decay<T>::type> make_ready_future(T&& value) {
+        promise<typename std::decay<T>::type> p;
+        auto fut = p.get_future();
+        p.set_value(std::forward<T>(value));
+        return fut;
+    }
+    inline future<void> make_ready_future() {
+        promise<void> p;
+        auto fut = p.get_future();
+        p.set_value();
+        return fut;
+    }
+
+    // ready once all futs are, with their values in the same order,
+    //   or the first error if any of them failed
+    template<class T>
+    typename std::enable_if<not std::is_void<T>::value,
+        future<std::vector<T>>>::type
+    when_all(std::vector<future<T>> futs) {
+        struct All
+        {
+            std::mutex mutex;
+            std::vector<boost::optional<T>> values;
+            size_t left;
+            promise<std::vector<T>> p;
+        };
+        auto all = std::make_shared<All>();
+        auto fut = all->p.get_future();
+        all->values.resize(futs.size());
+        all->left = futs.size();
+        if(futs.empty()) {
+            all->p.set_value(std::vector<T>());
+            return fut;
+        }
+        for(size_t i=0;i<futs.size();++i) {
+            auto state = std::move(futs[i].m_pState);
+            auto s = state.get();
+            s->on_ready([all, state, i]{
+                if(state->error) {
+                    all->p.set_exception(state->error);
+                    return;
+                }
+                std::unique_lock<std::mutex> l(all->mutex);
+                all->values[i] = state->take();
+                if(--all->left)
+                    return;
+                std::vector<T> r;
+                r.reserve(all->values.size());
+                for(auto&& v: all->values)
+                    r.push_back(std::move(*v));
+                l.unlock();
+                all->p.set_value(std::move(r));
+            });
+        }
+        return fut;
+    }
+    inline future<void> when_all(std::vector<future<void>> futs) {
+        struct All
+        {
+            std::atomic<size_t> left;
+            promise<void> p;
+        };
+        auto all = std::make_shared<All>();
+        auto fut = all->p.get_future();
+        all->left = futs.size();
+        if(futs.empty()) {
+            all->p.set_value();
+            return fut;
+        }
+        for(auto&& f: futs) {
+            auto state = std::move(f.m_pState);
+            auto s = state.get();
+            s->on_ready([all, state]{
+                if(state->error)
+                    all->p.set_exception(state->error);
+                else if(--all->left == 0)
+                    all->p.set_value();
+            });
+        }
+        return fut;
+    }
+
+    // ready with the index of whichever of futs is ready first
+    // futs are left alone, so the winner can still be get()'d
+    // Fails with std::invalid_argument if futs is empty, since nothing
+    //   could ever make it ready
+    template<class T>
+    future<size_t> when_any(std::vector<future<T>>& futs) {
+        auto p = std::make_shared<promise<size_t>>();
+        auto fut = p->get_future();
+        if(futs.empty()) {
+            p->set_exception(std::make_exception_ptr(
+                std::invalid_argument("when_any() of no futures")
+            ));
+            return fut;
+        }
+        for(size_t i=0;i<futs.size();++i)
+            futs[i].m_pState->on_ready([p, i]{
+                p->set_value(i); // only the first one sticks
+            });
+        return fut;
+    }
+}
+
+#endif
+
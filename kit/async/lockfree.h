@@ -0,0 +1,429 @@
+#ifndef LOCKFREE_H_M2QK7TXA
+#define LOCKFREE_H_M2QK7TXA
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include "../kit.h"
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+namespace kit
+{
+    // intrusive hook for mpsc_queue, inherit from this
+    struct mpsc_node
+    {
+        std::atomic<mpsc_node*> m_pNext = ATOMIC_VAR_INIT(nullptr);
+    };
+
+    /*
+     * Intrusive multi-producer/single-consumer queue (Dmitry Vyukov)
+     *
+     * push() never blocks and may be called from any thread
+     * pop() must only be called by one consumer at a time
+     *   (either one thread, or whoever holds the consumer's lock)
+     *
+     * pop() may briefly return nullptr while a producer is between its
+     *   two steps of push(), so consumers should not treat nullptr as
+     *   proof of emptiness unless they synchronize with producers in
+     *   some other way (see Multiplexer::Circuit::notify())
+     */
+    template<class T>
+    class mpsc_queue
+    {
+        public:
+
+            mpsc_queue():
+                m_pHead(&m_Stub),
+                m_pTail(&m_Stub)
+            {}
+
+            mpsc_queue(const mpsc_queue&) = delete;
+            mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+            void push(T* node) {
+                push(node, node);
+            }
+
+            // push a chain of nodes already linked from first to last
+            void push(T* first, T* last) {
+                last->m_pNext.store(nullptr, std::memory_order_relaxed);
+                mpsc_node* prev = m_pHead.exchange(last, std::memory_order_acq_rel);
+                prev->m_pNext.store(first, std::memory_order_release);
+            }
+
+            T* pop() {
+                mpsc_node* tail = m_pTail;
+                mpsc_node* next = tail->m_pNext.load(std::memory_order_acquire);
+                if(tail == &m_Stub) {
+                    if(not next)
+                        return nullptr;
+                    m_pTail = next;
+                    tail = next;
+                    next = next->m_pNext.load(std::memory_order_acquire);
+                }
+                if(next) {
+                    m_pTail = next;
+                    return static_cast<T*>(tail);
+                }
+                if(tail != m_pHead.load(std::memory_order_acquire))
+                    return nullptr; // producer is mid-push
+
+                // put the stub back so the last node can be released
+                push_stub();
+                next = tail->m_pNext.load(std::memory_order_acquire);
+                if(next) {
+                    m_pTail = next;
+                    return static_cast<T*>(tail);
+                }
+                return nullptr;
+            }
+
+            // only a hint unless called by the consumer
+            bool empty() const {
+                return m_pTail->m_pNext.load(std::memory_order_acquire) == nullptr &&
+                    m_pHead.load(std::memory_order_acquire) == m_pTail;
+            }
+
+        private:
+
+            void push_stub() {
+                m_Stub.m_pNext.store(nullptr, std::memory_order_relaxed);
+                mpsc_node* prev = m_pHead.exchange(&m_Stub, std::memory_order_acq_rel);
+                prev->m_pNext.store(&m_Stub, std::memory_order_release);
+            }
+
+            std::atomic<mpsc_node*> m_pHead;
+            char m_Pad[CACHE_LINE_SIZE - sizeof(std::atomic<mpsc_node*>)];
+            mpsc_node* m_pTail;
+            mpsc_node m_Stub;
+    };
+
+    namespace detail
+    {
+        // rings index with a mask, so capacity is a power of two
+        inline size_t ring_capacity(size_t capacity) {
+            size_t r = 2;
+            while(r < capacity)
+                r <<= 1;
+            return r;
+        }
+    }
+
+    /*
+     * Bounded single-producer/single-consumer ring buffer
+     *
+     * push() must only be called by one producer at a time and pop()
+     *   by one consumer at a time, neither ever blocks or locks
+     * Capacity is rounded up to a power of two
+     *
+     * Each side caches the other side's index and only reloads it when
+     *   the ring looks full (or empty), and both indices live on their
+     *   own cache lines, so the two threads don't keep stealing each
+     *   other's lines while the ring is neither
+     */
+    template<class T>
+    class spsc_ring
+    {
+        public:
+
+            explicit spsc_ring(size_t capacity):
+                m_Mask(detail::ring_capacity(capacity) - 1),
+                m_pSlots(new Slot[m_Mask + 1])
+            {}
+            ~spsc_ring() {
+                const size_t w = m_Write.load(std::memory_order_acquire);
+                for(size_t r = m_Read.load(std::memory_order_relaxed); r != w; ++r)
+                    slot(r)->~T();
+            }
+
+            spsc_ring(const spsc_ring&) = delete;
+            spsc_ring& operator=(const spsc_ring&) = delete;
+
+            // producer
+            template<class V>
+            bool push(V&& val) {
+                const size_t w = m_Write.load(std::memory_order_relaxed);
+                if(w - m_ReadCache > m_Mask) {
+                    m_ReadCache = m_Read.load(std::memory_order_acquire);
+                    if(w - m_ReadCache > m_Mask)
+                        return false;
+                }
+                new(slot(w)) T(std::forward<V>(val));
+                m_Write.store(w + 1, std::memory_order_release);
+                return true;
+            }
+
+            // producer, constructs as many of [first, last) as fit and
+            //   publishes them all at once, returns how many
+            template<class It>
+            size_t push(It first, It last) {
+                const size_t w = m_Write.load(std::memory_order_relaxed);
+                size_t n = std::distance(first, last);
+                if(w - m_ReadCache + n > m_Mask + 1)
+                    m_ReadCache = m_Read.load(std::memory_order_acquire);
+                n = std::min(n, m_Mask + 1 - (w - m_ReadCache));
+                for(size_t i = 0; i < n; ++i, ++first)
+                    new(slot(w + i)) T(*first);
+                if(n)
+                    m_Write.store(w + n, std::memory_order_release);
+                return n;
+            }
+
+            // consumer
+            bool pop(T& val) {
+                T* p = front();
+                if(not p)
+                    return false;
+                val = std::move(*p);
+                pop();
+                return true;
+            }
+            // consumer, the next value in place (or nullptr if empty),
+            //   which stays valid until pop()
+            T* front() {
+                const size_t r = m_Read.load(std::memory_order_relaxed);
+                if(r == m_WriteCache) {
+                    m_WriteCache = m_Write.load(std::memory_order_acquire);
+                    if(r == m_WriteCache)
+                        return nullptr;
+                }
+                return slot(r);
+            }
+            // consumer, drops the value front() returned
+            void pop() {
+                const size_t r = m_Read.load(std::memory_order_relaxed);
+                slot(r)->~T();
+                m_Read.store(r + 1, std::memory_order_release);
+            }
+
+            /*
+             * Consumer, calls func(first, last) on what has been pushed so
+             *   far, in place, then drops it all at once (even if func
+             *   throws), returns how many values that was
+             *
+             * func is called twice when the values wrap around the end of
+             *   the ring
+             */
+            template<class Func>
+            size_t consume(Func func) {
+                const size_t r = m_Read.load(std::memory_order_relaxed);
+                m_WriteCache = m_Write.load(std::memory_order_acquire);
+                const size_t n = m_WriteCache - r;
+                if(not n)
+                    return 0;
+                Release release{this, r, n};
+                const size_t first = std::min(n, m_Mask + 1 - (r & m_Mask));
+                func(slot(r), slot(r) + first);
+                if(first < n)
+                    func(slot(r + first), slot(r + first) + (n - first));
+                return n;
+            }
+
+            // only hints unless called by the consumer
+            size_t size() const {
+                return m_Write.load(std::memory_order_acquire) -
+                    m_Read.load(std::memory_order_acquire);
+            }
+            bool empty() const {
+                return size() == 0;
+            }
+            size_t capacity() const {
+                return m_Mask + 1;
+            }
+
+        private:
+
+            typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+            // drops n values starting at r, see consume()
+            struct Release
+            {
+                spsc_ring* ring;
+                size_t r;
+                size_t n;
+                ~Release() {
+                    for(size_t i = 0; i < n; ++i)
+                        ring->slot(r + i)->~T();
+                    ring->m_Read.store(r + n, std::memory_order_release);
+                }
+            };
+
+            T* slot(size_t idx) {
+                return reinterpret_cast<T*>(&m_pSlots[idx & m_Mask]);
+            }
+
+            const size_t m_Mask;
+            const std::unique_ptr<Slot[]> m_pSlots;
+            char m_Pad0[CACHE_LINE_SIZE];
+
+            // written by the producer
+            std::atomic<size_t> m_Write = ATOMIC_VAR_INIT(0);
+            size_t m_ReadCache = 0;
+            char m_Pad1[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+            // written by the consumer
+            std::atomic<size_t> m_Read = ATOMIC_VAR_INIT(0);
+            size_t m_WriteCache = 0;
+            char m_Pad2[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    };
+
+    /*
+     * Bounded multi-producer/single-consumer ring buffer (Dmitry Vyukov's
+     *   bounded queue, with a single consumer)
+     *
+     * push() never blocks and may be called from any thread, producers
+     *   claim slots with a CAS and mark each one ready with a per-slot
+     *   sequence number, so the consumer never waits on a lock
+     * pop() must only be called by one consumer at a time
+     * Capacity is rounded up to a power of two
+     */
+    template<class T>
+    class mpsc_ring
+    {
+        public:
+
+            explicit mpsc_ring(size_t capacity):
+                m_Mask(detail::ring_capacity(capacity) - 1),
+                m_pCells(new Cell[m_Mask + 1])
+            {
+                for(size_t i = 0; i <= m_Mask; ++i)
+                    m_pCells[i].seq.store(i, std::memory_order_relaxed);
+            }
+            ~mpsc_ring() {
+                while(front())
+                    pop();
+            }
+
+            mpsc_ring(const mpsc_ring&) = delete;
+            mpsc_ring& operator=(const mpsc_ring&) = delete;
+
+            template<class V>
+            bool push(V&& val) {
+                size_t w = m_Write.load(std::memory_order_relaxed);
+                Cell* cell;
+                while(true) {
+                    cell = &m_pCells[w & m_Mask];
+                    const size_t seq = cell->seq.load(std::memory_order_acquire);
+                    const std::ptrdiff_t diff = std::ptrdiff_t(seq - w);
+                    if(diff == 0) {
+                        if(m_Write.compare_exchange_weak(
+                            w, w + 1, std::memory_order_relaxed
+                        ))
+                            break;
+                    }
+                    else if(diff < 0)
+                        return false; // full
+                    else
+                        w = m_Write.load(std::memory_order_relaxed);
+                }
+                new(cell->value()) T(std::forward<V>(val));
+                cell->seq.store(w + 1, std::memory_order_release);
+                return true;
+            }
+
+            // pushes [first, last) in order until the ring is full,
+            //   returns how many (other producers may interleave)
+            template<class It>
+            size_t push(It first, It last) {
+                size_t n = 0;
+                for(; first != last; ++first, ++n)
+                    if(not push(*first))
+                        break;
+                return n;
+            }
+
+            // consumer
+            bool pop(T& val) {
+                T* p = front();
+                if(not p)
+                    return false;
+                val = std::move(*p);
+                pop();
+                return true;
+            }
+            // consumer, see spsc_ring::front()
+            T* front() {
+                const size_t r = m_Read.load(std::memory_order_relaxed);
+                Cell& cell = m_pCells[r & m_Mask];
+                if(cell.seq.load(std::memory_order_acquire) != r + 1)
+                    return nullptr;
+                return cell.value();
+            }
+            // consumer, drops the value front() returned
+            void pop() {
+                const size_t r = m_Read.load(std::memory_order_relaxed);
+                Cell& cell = m_pCells[r & m_Mask];
+                cell.value()->~T();
+                cell.seq.store(r + m_Mask + 1, std::memory_order_release);
+                m_Read.store(r + 1, std::memory_order_release);
+            }
+
+            // consumer, see spsc_ring::consume(), slots here aren't laid
+            //   out next to each other, so func gets one value at a time
+            //   (up to a ring's worth, so busy producers can't keep it here)
+            template<class Func>
+            size_t consume(Func func) {
+                size_t n = 0;
+                for(T* p; n <= m_Mask && (p = front()); ++n) {
+                    Release release{this};
+                    func(p, p + 1);
+                }
+                return n;
+            }
+
+            // only hints, this counts slots producers are still filling
+            size_t size() const {
+                const size_t r = m_Read.load(std::memory_order_acquire);
+                const size_t w = m_Write.load(std::memory_order_acquire);
+                return w > r ? w - r : 0;
+            }
+            bool empty() const {
+                return size() == 0;
+            }
+            size_t capacity() const {
+                return m_Mask + 1;
+            }
+
+        private:
+
+            // pops the front value when destroyed, see consume()
+            struct Release
+            {
+                mpsc_ring* ring;
+                ~Release() {
+                    ring->pop();
+                }
+            };
+
+            struct Cell
+            {
+                std::atomic<size_t> seq;
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+                T* value() {
+                    return reinterpret_cast<T*>(&storage);
+                }
+            };
+
+            const size_t m_Mask;
+            const std::unique_ptr<Cell[]> m_pCells;
+            char m_Pad0[CACHE_LINE_SIZE];
+
+            // shared by the producers
+            std::atomic<size_t> m_Write = ATOMIC_VAR_INIT(0);
+            char m_Pad1[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+
+            // written by the consumer
+            std::atomic<size_t> m_Read = ATOMIC_VAR_INIT(0);
+            char m_Pad2[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    };
+}
+
+#endif
+
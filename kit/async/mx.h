@@ -8,10 +8,26 @@
 #include <boost/coroutine/all.hpp>
 #include <boost/smart_ptr/make_local_shared.hpp>
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
 #include "../kit.h"
 #include "task.h"
+#include "small_function.h"
+#include "future.h"
+#include "lockfree.h"
+#include "timer_wheel.h"
+#include "reactor.h"
+#include "pool.h"
+#include "affinity.h"
+#include "blocking_pool.h"
 
 #define MX Multiplexer::get()
 
@@ -23,6 +39,85 @@
 #define MX_FREQ 0
 #endif
 
+// how circuits wait out the rest of a tick when MX_FREQ or frequency()
+//   is set (see Multiplexer::Stabilizer)
+#ifndef MX_STABILIZER
+#define MX_STABILIZER SLEEP
+#endif
+
+// idle circuits steal work from busy ones (can be toggled with MX.stealing())
+#ifndef MX_STEAL
+#define MX_STEAL 0
+#endif
+
+// how often (in microseconds) an idle circuit retries stealing when
+//   no busy circuit has woken it up
+#ifndef MX_STEAL_INTERVAL
+#define MX_STEAL_INTERVAL 1000
+#endif
+
+// coroutine stack size in bytes (0 is boost's default),
+//   can be changed later with MX.stack_size()
+#ifndef MX_STACK_SIZE
+#define MX_STACK_SIZE 0
+#endif
+
+// put a guard page below each coroutine stack to catch overflows
+#ifndef MX_STACK_GUARD
+#define MX_STACK_GUARD 1
+#endif
+
+// finished coroutines' stacks kept around for reuse (per multiplexer)
+#ifndef MX_STACK_POOL
+#define MX_STACK_POOL 1024
+#endif
+
+// lower priority units (see Multiplexer::UnitFlags) get to run at least
+//   once every MX_STARVATION turns given to higher priority units
+#ifndef MX_STARVATION
+#define MX_STARVATION 16
+#endif
+
+// how any_circuit() picks a circuit (see Multiplexer::Placement),
+//   can be changed later with MX.placement()
+#ifndef MX_PLACEMENT
+#define MX_PLACEMENT POWER_OF_TWO
+#endif
+
+// time each unit run for CircuitStats (can be toggled with MX.timing())
+#ifndef MX_TIMING
+#define MX_TIMING 0
+#endif
+
+// microseconds a unit may run before maybe_yield() actually yields,
+//   0 means it never does (can be changed with MX.time_slice())
+#ifndef MX_TIME_SLICE
+#define MX_TIME_SLICE 0
+#endif
+
+// units running longer than this many microseconds at once are counted
+//   as overruns, 0 turns this off (can be changed with MX.overrun())
+#ifndef MX_OVERRUN
+#define MX_OVERRUN 0
+#endif
+
+// most threads MX.blocking() runs blocking calls on
+#ifndef MX_BLOCKING_THREADS
+#define MX_BLOCKING_THREADS 8
+#endif
+
+// which cpus circuit threads are pinned to (see Multiplexer::Affinity),
+//   can be changed later with MX.affinity()
+#ifndef MX_AFFINITY
+#define MX_AFFINITY AFFINITY_NONE
+#endif
+
+// bytes a unit keeps its task in before allocating it, enough for a
+//   Task with TASK_BUFFER bytes of captures
+#ifndef MX_UNIT_BUFFER
+#define MX_UNIT_BUFFER (TASK_BUFFER + 64)
+#endif
+
 #ifndef CACHE_LINE_SIZE
 #define CACHE_LINE_SIZE 64
 #endif
@@ -43,6 +138,20 @@ typedef boost::coroutines::coroutine<void>::push_type push_coro_t;
     }()
 #define AWAIT(EXPR) AWAIT_MX(MX, EXPR)
 
+// async await a non-throwing attempt, such as the try_*() functions
+//   on channels and sockets (continously yield until EXPR is truthy)
+// this skips exception handling entirely when used inside coroutines
+#define AWAIT_TRY_MX(MUX, EXPR) \
+    [&]{\
+        while(true){\
+            auto r = (EXPR);\
+            if(r)\
+                return r;\
+            MUX.yield();\
+        }\
+    }()
+#define AWAIT_TRY(EXPR) AWAIT_TRY_MX(MX, EXPR)
+
 // async await a condition (continously yield until condition is true)
 #define YIELD_WHILE_MX(MUX, EXPR) \
     [&]{\
@@ -57,6 +166,10 @@ typedef boost::coroutines::coroutine<void>::push_type push_coro_t;
 #define YIELD_MX(MUX) MUX.yield();
 #define YIELD() YIELD_MX(MX)
 
+// yield only if this coroutine has used up its time slice
+#define MAYBE_YIELD_MX(MUX) MUX.maybe_yield();
+#define MAYBE_YIELD() MAYBE_YIELD_MX(MX)
+
 #define AWAIT_HINT_MX(MUX, HINT, EXPR) \
     [&]{\
         bool once = false;\
@@ -82,6 +195,39 @@ typedef boost::coroutines::coroutine<void>::push_type push_coro_t;
 
 #define AWAIT_HINT(HINT, EXPR) AWAIT_HINT_MX(MUX, HINT, EXPR)
 
+// async await EXPR, parking the coroutine on WAITLIST between attempts
+//   instead of polling, so it is only retried after WAITLIST is notified
+// outside of coroutines this behaves like AWAIT()
+#define AWAIT_ON_MX(MUX, WAITLIST, EXPR) \
+    [&]{\
+        auto waiting = MUX.waiting(WAITLIST);\
+        while(true){\
+            try{\
+                return (EXPR);\
+            }catch(const kit::yield_exception&){\
+                waiting.next();\
+            }\
+        }\
+    }()
+#define AWAIT_ON(WAITLIST, EXPR) AWAIT_ON_MX(MX, WAITLIST, EXPR)
+
+// async await EXPR on a socket (or any fd), parking the coroutine until
+//   FD is ready for EVENTS (Multiplexer::READ and/or WRITE) between attempts
+// outside of coroutines this behaves like AWAIT()
+#define AWAIT_IO_MX(MUX, FD, EVENTS, EXPR) \
+    [&]{\
+        while(true){\
+            try{\
+                return (EXPR);\
+            }catch(const kit::yield_exception&){\
+                MUX.wait_io(FD, EVENTS);\
+            }\
+        }\
+    }()
+#define AWAIT_IO(FD, EVENTS, EXPR) AWAIT_IO_MX(MX, FD, EVENTS, EXPR)
+#define AWAIT_READ(FD, EXPR) AWAIT_IO(FD, Multiplexer::READ, EXPR)
+#define AWAIT_WRITE(FD, EXPR) AWAIT_IO(FD, Multiplexer::WRITE, EXPR)
+
 // coroutine async sleep()
 #define MX_SLEEP(TIME) Multiplexer::sleep(TIME);
 
@@ -90,42 +236,263 @@ typedef boost::coroutines::coroutine<void>::push_type push_coro_t;
 
 #define MX_EPSILON 0.00001
 
+class WaitList;
+
 class Multiplexer:
     public kit::singleton<Multiplexer>
 {
     public:
 
-        struct Unit
+        // passed to Circuit::when(), task() and coro()
+        enum UnitFlags {
+            // never migrate this unit to another circuit (work stealing)
+            PINNED = kit::bit(0),
+            // priority classes, units are NORMAL unless given one of these
+            // higher classes run first, see MX_STARVATION
+            REALTIME = kit::bit(1),
+            BACKGROUND = kit::bit(2)
+        };
+        enum Priority {
+            PRIORITY_REALTIME,
+            PRIORITY_NORMAL,
+            PRIORITY_BACKGROUND,
+            NUM_PRIORITIES
+        };
+        
+        // any_circuit() policies, based on each circuit's load()
+        enum Placement {
+            RANDOM,
+            ROUND_ROBIN,
+            LEAST_QUEUED, // scans every circuit
+            POWER_OF_TWO // least queued of two random circuits
+        };
+        
+        // how circuit threads are pinned to cpus, circuits are laid out
+        //   over kit::cpu_order() so neighbouring circuits share a NUMA
+        //   node, and a node fills up before the next one is used
+        // NOTE: only the threads are pinned, circuits and their queues are
+        //   allocated by the thread constructing the Multiplexer, so they
+        //   live on that thread's node, not their circuit's
+        enum Affinity {
+            AFFINITY_NONE, // the OS moves circuits around as it likes
+            AFFINITY_CORE, // each circuit stays on one cpu
+            AFFINITY_NODE // each circuit stays on the NUMA node of that cpu
+        };
+        
+        // how a circuit with a frequency() waits for its next tick
+        enum Stabilizer {
+            SLEEP, // cheap, but only as precise as the OS scheduler
+            HYBRID // sleeps most of the tick, then spins until it's due
+        };
+        
+        // passed to wait_io() and AWAIT_IO() (same bits as kit::reactor)
+        enum IoEvents {
+            READ = kit::bit(0),
+            WRITE = kit::bit(1)
+        };
+
+        // buckets in CircuitStats::run_times
+        static const unsigned TIME_BUCKETS = 16;
+        
+        /*
+         * What a circuit has been doing, see Circuit::stats()
+         *
+         * Counters only ever grow, diff two snapshots to get rates
+         * run_ns and run_times stay at zero unless timing() is on
+         */
+        struct CircuitStats
+        {
+            unsigned index = 0;
+            size_t size = 0; // see Circuit::size()
+            size_t load = 0; // see Circuit::load()
+            uint64_t submitted = 0; // units handed to this circuit
+            uint64_t runs = 0; // units run or resumed
+            uint64_t completed = 0;
+            uint64_t yields = 0; // runs that yielded without parking
+            uint64_t parks = 0;
+            uint64_t steals = 0; // units taken from other circuits
+            uint64_t stolen = 0; // units taken by other circuits
+            uint64_t overruns = 0; // runs longer than overrun()
+            uint64_t run_ns = 0; // time spent running units
+            // runs by how long they took: [0] under 1us, [i] under
+            //   2^i us, and the last bucket gets everything longer
+            std::array<uint64_t, TIME_BUCKETS> run_times;
+            
+            CircuitStats() {
+                run_times.fill(0);
+            }
+        };
+        
+        // told about each overrun(), on the circuit that ran the unit
+        typedef std::function<void(unsigned circuit, std::chrono::nanoseconds)>
+            OverrunHandler;
+        
+        class Circuit;
+        struct Waiter;
+        struct Unit;
+
+        // runs one step of a unit, returns false when it needs to run again
+        typedef kit::small_function<bool(), MX_UNIT_BUFFER> UnitFunc;
+        
+        // gets whatever a post()ed or spawn_detached() unit threw
+        typedef std::function<void(std::exception_ptr)> ErrorHandler;
+        
+        /*
+         * Cancellation token shared by a group of units
+         *
+         * Units join the group of the innermost TaskGroup::Scope on the
+         *   thread that creates them, or else the group of the unit
+         *   creating them, so whatever a coroutine spawns is cancelled
+         *   along with it
+         *
+         * cancel() wakes the group's parked units, and its units are
+         *   destroyed instead of run the next time their circuit gets to
+         *   them, unwinding coroutine stacks
+         * Running units finish their current step first (until they
+         *   yield or park), MX.cancelled() lets them stop sooner
+         * Futures of cancelled units are broken (std::future_error)
+         *
+         * Copies refer to the same group
+         */
+        class TaskGroup
+        {
+            private:
+                
+                friend class Circuit;
+                friend struct Unit;
+                
+                struct State:
+                    public std::enable_shared_from_this<State>
+                {
+                    State();
+                    ~State();
+                    // wake w if the group is cancelled while it's parked
+                    void watch(const std::shared_ptr<Waiter>& w);
+                    void leave();
+                    
+                    std::atomic<bool> cancelled = ATOMIC_VAR_INIT(false);
+                    std::atomic<size_t> units = ATOMIC_VAR_INIT(0);
+                    std::mutex mutex;
+                    std::condition_variable cond;
+                    std::unique_ptr<WaitList> waiters;
+                    // parked units, some of which have resumed since
+                    std::vector<std::weak_ptr<Waiter>> parked;
+                    size_t pruned = 0;
+                };
+                
+            public:
+                
+                TaskGroup():
+                    m_pState(std::make_shared<State>())
+                {}
+                
+                void cancel();
+                bool cancelled() const {
+                    return m_pState->cancelled;
+                }
+                // units of this group that haven't finished yet
+                size_t size() const {
+                    return m_pState->units;
+                }
+                bool empty() const {
+                    return size() == 0;
+                }
+                // until every unit of this group is gone (parks coroutines)
+                void wait(Multiplexer& mx = MX);
+                
+                // units created on this thread while a Scope is alive
+                //   join its group
+                class Scope
+                {
+                    public:
+                        explicit Scope(TaskGroup& group):
+                            m_pPrev(scoped())
+                        {
+                            scoped() = group.m_pState.get();
+                        }
+                        ~Scope() {
+                            scoped() = m_pPrev;
+                        }
+                        Scope(const Scope&) = delete;
+                        Scope& operator=(const Scope&) = delete;
+                    private:
+                        friend struct Unit;
+                        static TaskGroup::State*& scoped() {
+                            static thread_local TaskGroup::State* state = nullptr;
+                            return state;
+                        }
+                        TaskGroup::State* m_pPrev;
+                };
+                
+            private:
+                
+                std::shared_ptr<State> m_pState;
+        };
+        
+        struct Unit:
+            public kit::mpsc_node,
+            public kit::pooled<Unit>
         {
             Unit(
                 std::function<bool()> rdy,
-                std::function<void()> func,
-                std::unique_ptr<push_coro_t>&& push,
+                UnitFunc func,
+                push_coro_t&& push,
                 pull_coro_t* pull
             ):
                 m_Ready(rdy),
-                m_Func(func),
-                m_pPush(std::move(push)),
+                m_Func(std::move(func)),
+                m_Push(std::move(push)),
                 m_pPull(pull)
-            {}
+            {
+                join_group();
+            }
             
             Unit(
                 std::function<bool()> rdy,
-                std::function<void()> func
+                UnitFunc func,
+                unsigned flags = 0
             ):
                 m_Ready(rdy),
-                m_Func(func)
-            {}
+                m_Func(std::move(func)),
+                m_Flags(flags)
+            {
+                join_group();
+            }
+
+            ~Unit();
 
             bool is_coroutine() const {
                 return m_pPull;
             }
+            bool pinned() const {
+                return m_Flags & PINNED;
+            }
+            Priority priority() const {
+                if(m_Flags & REALTIME)
+                    return PRIORITY_REALTIME;
+                if(m_Flags & BACKGROUND)
+                    return PRIORITY_BACKGROUND;
+                return PRIORITY_NORMAL;
+            }
             
             // only a hint, assume ready if functor is 'empty'
             std::function<bool()> m_Ready; 
-            Task<void()> m_Func;
-            std::unique_ptr<push_coro_t> m_pPush;
+            // runs one step, returns false when it needs to run again
+            UnitFunc m_Func;
+            push_coro_t m_Push;
             pull_coro_t* m_pPull = nullptr;
+            unsigned m_Flags = 0;
+            // set while the unit is registered on something to wake it up
+            std::shared_ptr<Waiter> m_pWaiter;
+            bool m_bPark = false;
+            // when_at() units are held back until this passes
+            std::chrono::steady_clock::time_point m_Deadline;
+            // see TaskGroup
+            std::shared_ptr<TaskGroup::State> m_pGroup;
+            bool cancelled() const {
+                return m_pGroup && m_pGroup->cancelled;
+            }
+            void join_group();
             // TODO: idletime hints for load balancing?
         };
 
@@ -137,88 +504,287 @@ class Multiplexer:
             
             Circuit(Multiplexer* mx, unsigned idx):
                 m_pMultiplexer(mx),
-                m_Index(idx)
+                m_Index(idx),
+                m_Cpus(mx->cpus(idx, mx->m_Affinity))
             {
+                if(MX_FREQ)
+                    frequency(MX_FREQ);
                 run();
             }
-            virtual ~Circuit() {}
+            virtual ~Circuit() {
+                // units queued after the circuit stopped
+                while(Unit* unit = m_Inbox.pop())
+                    delete unit;
+                while(Waiter* w = m_Wakeups.pop())
+                    w->m_pSelf.reset();
+            }
 
+            // yield() once the running unit has been running for longer
+            //   than MX.time_slice(), returns false if it didn't yield
+            // cheap enough to call inside tight loops
+            // only coroutines yield here, tasks would be restarted from
+            //   the top (like YIELD()), so for them this does nothing
+            bool maybe_yield() {
+                if(m_SliceEnd == std::chrono::steady_clock::time_point::max() ||
+                    std::chrono::steady_clock::now() < m_SliceEnd
+                )
+                    return false;
+                Unit* unit = m_pCurrentUnit;
+                if(not unit || not unit->m_pPull)
+                    return false;
+                yield();
+                return true;
+            }
+            
             void yield() {
-                if(m_pCurrentUnit && m_pCurrentUnit->m_pPull)
-                    (*m_pCurrentUnit->m_pPull)();
+                Unit* unit = m_pCurrentUnit;
+                if(unit && unit->m_pPull)
+                    (*unit->m_pPull)();
                 else
                     throw kit::yield_exception();
                 //else
                 //    boost::this_thread::yield();
             }
             
-            template<class T = void>
-            std::future<T> when(std::function<bool()> cond, std::function<T()> cb) {
-                while(true) {
-                    boost::this_thread::interruption_point();
-                    {
-                        auto l = lock();
-                        if(!m_Buffered || m_Units.size() < m_Buffered) {
-                            auto cbt = Task<T()>(std::move(cb));
-                            auto fut = cbt.get_future();
-                            auto cbc = boost::make_local_shared<Task<T()>>(std::move(cbt));
-                            m_Units.emplace_back(cond, [cbc]() {
-                                (*cbc)();
-                            });
-                            m_CondVar.notify_one();
-                            return fut;
-                        }
-                    }
-                    boost::this_thread::yield();
-                }
+            // NOTE: when(), coro() and task() wait while a buffered circuit
+            //   is full (see buffer()), use the try_*() versions below
+            //   to give up instead
+            // cb is any callable returning T, small ones are stored
+            //   without allocating (see TASK_BUFFER)
+            template<class T = void, class Func>
+            std::future<T> when(
+                std::function<bool()> cond,
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                std::future<T> fut;
+                enqueue(task_unit<T>(
+                    std::move(cond), std::forward<Func>(cb), flags, fut
+                ));
+                return fut;
             }
 
+            template<class T = void, class Func>
+            std::future<T> coro(Func&& cb, unsigned flags = 0) {
+                std::future<T> fut;
+                enqueue(coro_unit<T>(std::forward<Func>(cb), flags, fut));
+                return fut;
+            }
+            
+            template<class T = void, class Func>
+            std::future<T> task(Func&& cb, unsigned flags = 0) {
+                return when<T>(
+                    std::function<bool()>(), std::forward<Func>(cb), flags
+                );
+            }
+            
+            // task() and coro() for fire-and-forget work, without
+            //   allocating a promise or future
+            // on_error gets anything cb throws (it is dropped otherwise),
+            //   and runs on this circuit so it must not throw itself
+            template<class Func>
+            void post(
+                Func&& cb,
+                unsigned flags = 0,
+                ErrorHandler on_error = ErrorHandler()
+            ) {
+                enqueue(kit::make_unique<Unit>(
+                    std::function<bool()>(),
+                    PostEntry<typename std::decay<Func>::type>(
+                        std::forward<Func>(cb), std::move(on_error)
+                    ),
+                    flags
+                ));
+            }
+            template<class Func>
+            void spawn_detached(
+                Func&& cb,
+                unsigned flags = 0,
+                ErrorHandler on_error = ErrorHandler()
+            ) {
+                enqueue(coro_unit(
+                    PostEntry<typename std::decay<Func>::type>(
+                        std::forward<Func>(cb), std::move(on_error)
+                    ),
+                    flags
+                ));
+            }
+            
+            // task() and coro() returning kit::future, for chaining
+            //   continuations with then(), when_all() and when_any()
             template<class T = void>
-            std::future<T> coro(std::function<T()> cb) {
-                while(true) {
-                    boost::this_thread::interruption_point();
-                    {
-                        auto l = lock();
-                        if(!m_Buffered || m_Units.size() < m_Buffered) {
-                            auto cbt = Task<T()>(std::move(cb));
-                            auto fut = cbt.get_future();
-                            auto cbc = boost::make_local_shared<Task<T()>>(std::move(cbt));
-                            m_Units.emplace_back(
-                                std::function<bool()>(),
-                                std::function<void()>()
-                            );
-                            auto* pullptr = &m_Units.back().m_pPull;
-                            m_Units.back().m_pPush = kit::make_unique<push_coro_t>(
-                                [cbc, pullptr](pull_coro_t& sink){
-                                    *pullptr = &sink;
-                                    (*cbc)();
-                                }
-                            );
-                            auto* coroptr = m_Units.back().m_pPush.get();
-                            m_Units.back().m_Ready = std::function<bool()>(
-                                [coroptr]() -> bool {
-                                    return bool(*coroptr);
-                                }
-                            );
-                            m_Units.back().m_Func = Task<void()>(std::function<void()>(
-                                [coroptr]{
-                                    (*coroptr)();
-                                    if(*coroptr) // not completed?
-                                        throw kit::yield_exception(); // continue
-                                }
-                            ));
-                            m_CondVar.notify_one();
-                            return fut;
-                        }
-                    }
-                    boost::this_thread::yield();
-                }
-
+            kit::future<T> async(std::function<T()> cb, unsigned flags = 0) {
+                auto p = std::make_shared<kit::promise<T>>();
+                auto fut = p->get_future();
+                task<void>([p, cb]{
+                    kit::detail::invoke<T>::attempt(*p, cb);
+                }, flags);
+                return fut;
+            }
+            template<class T = void>
+            kit::future<T> async_coro(std::function<T()> cb, unsigned flags = 0) {
+                auto p = std::make_shared<kit::promise<T>>();
+                auto fut = p->get_future();
+                coro<void>([p, cb]{
+                    kit::detail::invoke<T>::attempt(*p, cb);
+                }, flags);
+                return fut;
             }
             
+            // task() and coro() that give up if the circuit is still full
+            //   by deadline (right away for try_task() and try_coro())
+            template<class T = void, class Func>
+            boost::optional<std::future<T>> try_task_until(
+                std::chrono::steady_clock::time_point deadline,
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                std::future<T> fut;
+                if(not enqueue(
+                    task_unit<T>(
+                        std::function<bool()>(), std::forward<Func>(cb), flags, fut
+                    ),
+                    deadline
+                ))
+                    return boost::none;
+                return boost::optional<std::future<T>>(std::move(fut));
+            }
+            template<class T = void, class Func>
+            boost::optional<std::future<T>> try_coro_until(
+                std::chrono::steady_clock::time_point deadline,
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                std::future<T> fut;
+                if(not enqueue(
+                    coro_unit<T>(std::forward<Func>(cb), flags, fut),
+                    deadline
+                ))
+                    return boost::none;
+                return boost::optional<std::future<T>>(std::move(fut));
+            }
+            template<class T = void, class Func>
+            boost::optional<std::future<T>> try_task(
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                return try_task_until<T>(
+                    std::chrono::steady_clock::time_point(),
+                    std::forward<Func>(cb), flags
+                );
+            }
+            template<class T = void, class Func>
+            boost::optional<std::future<T>> try_coro(
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                return try_coro_until<T>(
+                    std::chrono::steady_clock::time_point(),
+                    std::forward<Func>(cb), flags
+                );
+            }
+            template<class T = void, class Duration, class Func>
+            boost::optional<std::future<T>> try_task_for(
+                Duration d,
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                return try_task_until<T>(
+                    std::chrono::steady_clock::now() + d,
+                    std::forward<Func>(cb), flags
+                );
+            }
+            template<class T = void, class Duration, class Func>
+            boost::optional<std::future<T>> try_coro_for(
+                Duration d,
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                return try_coro_until<T>(
+                    std::chrono::steady_clock::now() + d,
+                    std::forward<Func>(cb), flags
+                );
+            }
+            
+            // task() for many callbacks at once: the units are published
+            //   to the circuit together and it is only woken up once
+            //   (or once per chunk, if the circuit is buffered)
             template<class T = void>
-            std::future<T> task(std::function<T()> cb) {
-                return when(std::function<bool()>(), cb);
+            std::vector<std::future<T>> submit_batch(
+                std::vector<std::function<T()>> cbs,
+                unsigned flags = 0
+            ) {
+                std::vector<std::future<T>> futs;
+                std::vector<std::unique_ptr<Unit>> units;
+                futs.reserve(cbs.size());
+                units.reserve(cbs.size());
+                for(auto&& cb: cbs) {
+                    auto cbt = Task<T()>(std::move(cb));
+                    futs.push_back(cbt.get_future());
+                    units.push_back(kit::make_unique<Unit>(
+                        std::function<bool()>(),
+                        TaskEntry<T>(std::move(cbt)),
+                        flags
+                    ));
+                }
+                enqueue(units);
+                return futs;
+            }
+            
+            // submit_batch() with a single future for the whole batch,
+            //   ready once every callback has run
+            // if any of them threw, holds the first exception
+            std::future<void> submit_batch_all(
+                std::vector<std::function<void()>> cbs,
+                unsigned flags = 0
+            ) {
+                auto batch = std::make_shared<Batch>(cbs.size());
+                auto fut = batch->promise.get_future();
+                if(cbs.empty()) {
+                    batch->promise.set_value();
+                    return fut;
+                }
+                std::vector<std::unique_ptr<Unit>> units;
+                units.reserve(cbs.size());
+                for(auto&& cb: cbs) {
+                    auto cbc = boost::make_local_shared<std::function<void()>>(
+                        std::move(cb)
+                    );
+                    units.push_back(kit::make_unique<Unit>(
+                        std::function<bool()>(),
+                        [batch, cbc]() {
+                            try{
+                                (*cbc)();
+                            }catch(const kit::yield_exception&){
+                                return false;
+                            }catch(...){
+                                batch->fail(std::current_exception());
+                            }
+                            batch->done();
+                            return true;
+                        },
+                        flags
+                    ));
+                }
+                enqueue(units);
+                return fut;
+            }
+            
+            // task() that doesn't start until deadline, without being polled
+            //   in the meantime
+            template<class T = void, class Func>
+            std::future<T> when_at(
+                std::chrono::steady_clock::time_point deadline,
+                Func&& cb,
+                unsigned flags = 0
+            ) {
+                std::future<T> fut;
+                auto unit = task_unit<T>(
+                    std::function<bool()>(), std::forward<Func>(cb), flags, fut
+                );
+                unit->m_Deadline = deadline;
+                enqueue(std::move(unit));
+                return fut;
             }
             
             // TODO: handle single-direction channels that may block
@@ -249,16 +815,30 @@ class Multiplexer:
 
             void run() {
                 m_Thread = boost::thread([this]{
-                    m_pMultiplexer->m_ThreadToCircuit.with<void>(
-                        [this](std::map<boost::thread::id, unsigned>& m){
-                            m[boost::this_thread::get_id()] = m_Index;
-                        }
-                    );
-                    unsigned idx = 0;
+                    current() = this;
+                    // before running anything, so units never start on
+                    //   the wrong cpu
+                    {
+                        auto l = lock();
+                        if(not m_Cpus.empty())
+                            kit::pin_this_thread(m_Cpus);
+                    }
                     try{
-                        while(next(idx)){}
+                        while(next()){}
                     }catch(const boost::thread_interrupted&){
-                        m_Units.clear(); // this will unwind coros immediately
+                        decltype(m_Units) units;
+                        decltype(m_Parked) parked;
+                        {
+                            auto l = lock();
+                            drain();
+                            units.swap(m_Units);
+                            parked.swap(m_Parked);
+                            parked_changed();
+                        }
+                        release(units.size() + parked.size());
+                        // this will unwind coros immediately
+                        units.clear();
+                        parked.clear();
                     }
                 });
                 //#ifdef __WIN32__
@@ -272,10 +852,7 @@ class Multiplexer:
             //}
             void finish_nojoin() {
                 m_Finish = true;
-                {
-                    auto l = this->lock<boost::unique_lock<boost::mutex>>();
-                    m_CondVar.notify_one();
-                }
+                wakeup();
             }
             void join() {
                 if(m_Thread.joinable())
@@ -283,10 +860,7 @@ class Multiplexer:
             }
             void finish() {
                 m_Finish = true;
-                {
-                    auto l = this->lock<boost::unique_lock<boost::mutex>>();
-                    m_CondVar.notify_one();
-                }
+                wakeup();
                 if(m_Thread.joinable()) {
                     m_Thread.join();
                 }
@@ -294,16 +868,22 @@ class Multiplexer:
             void stop() {
                 if(m_Thread.joinable()) {
                     m_Thread.interrupt();
-                    {
-                        auto l = this->lock<boost::unique_lock<boost::mutex>>();
-                        m_CondVar.notify_one();
-                    }
+                    wakeup();
                     m_Thread.join();
                 }
             }
+            // includes queued, waiting and running units
             bool empty() const {
-                auto l = this->lock<boost::unique_lock<boost::mutex>>();
-                return m_Units.empty();
+                return m_Size == 0;
+            }
+            size_t size() const {
+                return m_Size;
+            }
+            // units that are queued or running (not parked), a hint
+            size_t load() const {
+                const size_t sz = m_Size;
+                const size_t parked = m_NumParked.load(std::memory_order_relaxed);
+                return sz > parked ? sz - parked : 0;
             }
             void sync() {
                 while(true){
@@ -313,16 +893,18 @@ class Multiplexer:
                 };
             }
             size_t buffered() const {
-                auto l = lock();
                 return m_Buffered;
             }
             void unbuffer() {
-                auto l = lock();
                 m_Buffered = 0;
+                not_full();
             }
+            // limits queued, waiting and running units to sz
+            // producers wait for room once it's full: threads block,
+            //   coroutines park until a unit finishes here
             void buffer(size_t sz) {
-                auto l = lock();
                 m_Buffered = sz;
+                not_full();
             }
 
             //virtual bool poll_once() override { assert(false); }
@@ -330,105 +912,1140 @@ class Multiplexer:
             //virtual void run_once() override { assert(false); }
             
             Unit* this_unit() { return m_pCurrentUnit; }
+            unsigned index() const { return m_Index; }
+            Multiplexer& multiplexer() { return *m_pMultiplexer; }
+            
+            // restricts this circuit's thread to cpus (any cpu if empty)
+            // returns false if pinning isn't supported or failed
+            bool pin(std::vector<unsigned> cpus) {
+                auto l = lock();
+                m_Cpus = std::move(cpus);
+                if(not m_Thread.joinable())
+                    return false;
+                return kit::pin_thread(m_Thread.native_handle(), m_Cpus);
+            }
+            std::vector<unsigned> cpus() {
+                auto l = lock();
+                return m_Cpus;
+            }
+
+            /*
+             * Event-driven waiting for the current coroutine:
+             *   register the returned waiter with whatever will notify it,
+             *   re-check your condition, then park() if still not ready
+             * Returns nullptr outside of coroutines (poll instead)
+             */
+            std::shared_ptr<Waiter> prepare_wait() {
+                Unit* unit = m_pCurrentUnit;
+                if(not unit || not unit->m_pPull)
+                    return std::shared_ptr<Waiter>();
+                cancel_wait();
+                unit->m_pWaiter = std::make_shared<Waiter>(this, unit);
+                return unit->m_pWaiter;
+            }
+            // suspend the current coroutine until its waiter is notified
+            // the circuit stops scheduling it in the meantime
+            void park() {
+                Unit* unit = m_pCurrentUnit;
+                assert(unit && unit->m_pWaiter);
+                unit->m_bPark = true;
+                (*unit->m_pPull)();
+                // NOTE: this circuit may not be ours anymore
+                if(unit->m_pWaiter) { // notified before we parked
+                    unit->m_pWaiter->done();
+                    unit->m_pWaiter.reset();
+                }
+            }
+            // suspend the current coroutine until deadline
+            // must be called from inside this circuit, tasks are retried
+            //   (see yield()) until the deadline passes instead
+            void sleep_until(std::chrono::steady_clock::time_point deadline) {
+                auto waiter = prepare_wait();
+                if(not waiter) { // not a coroutine, poll
+                    while(std::chrono::steady_clock::now() < deadline)
+                        yield();
+                    return;
+                }
+                if(std::chrono::steady_clock::now() >= deadline) {
+                    cancel_wait();
+                    return;
+                }
+                add_timer(deadline, std::move(waiter));
+                park();
+            }
+            // suspend the current coroutine until fd is ready for events
+            // must be called from inside this circuit, tasks (and systems
+            //   without epoll) are retried (see yield()) instead
+            void wait_io(int fd, unsigned events) {
+                auto waiter = prepare_wait();
+                if(not waiter) { // not a coroutine, poll
+                    yield();
+                    return;
+                }
+                // only the circuit thread touches the reactor
+                if(not m_Reactor.add(fd, events, std::move(waiter))) {
+                    cancel_wait();
+                    yield();
+                    return;
+                }
+                // units cancelled or destroyed while waiting leave their
+                //   waiters behind, drop those every time it doubles
+                if(m_Reactor.size() >= m_IoPrune)
+                    prune_io();
+                park();
+            }
+            // condition became true before park(), stop waiting
+            void cancel_wait() {
+                Unit* unit = m_pCurrentUnit;
+                if(unit && unit->m_pWaiter) {
+                    unit->m_pWaiter->done();
+                    unit->m_pWaiter.reset();
+                }
+            }
             
             // expressed in maximum acceptable ticks per second when idle
+            // (a tick is one pass through the circuit's units)
             void frequency(float freq) {
                 auto lck = this->lock<boost::unique_lock<boost::mutex>>();
                 m_Frequency = freq;
+                m_Period = freq > MX_EPSILON ?
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(1.0 / freq)
+                    ) :
+                    std::chrono::steady_clock::duration::zero();
+                m_SpinMargin = m_Period / 4;
+                m_NextTick = std::chrono::steady_clock::time_point();
+                m_TickStats = TickAccum();
+            }
+            float frequency() const {
+                auto lck = this->lock<boost::unique_lock<boost::mutex>>();
+                return m_Frequency;
+            }
+            void stabilizer(Stabilizer s) {
+                auto lck = this->lock<boost::unique_lock<boost::mutex>>();
+                m_Stabilizer = s;
+            }
+            Stabilizer stabilizer() const {
+                auto lck = this->lock<boost::unique_lock<boost::mutex>>();
+                return m_Stabilizer;
+            }
+            
+            // how closely a circuit with a frequency() is keeping up,
+            //   measured over the ticks since the last reset_tick_stats()
+            //   (or frequency() change), ticks after being idle don't count
+            struct TickStats
+            {
+                size_t ticks = 0;
+                // achieved ticks per second
+                double frequency = 0.0;
+                // standard deviation of the tick period
+                std::chrono::nanoseconds jitter{0};
+                // largest difference from the target period
+                std::chrono::nanoseconds max_jitter{0};
+            };
+            TickStats tick_stats() const {
+                auto lck = this->lock<boost::unique_lock<boost::mutex>>();
+                const auto& a = m_TickStats;
+                TickStats r;
+                r.ticks = a.ticks;
+                if(a.ticks && a.sum > 0.0) {
+                    const double mean = a.sum / a.ticks;
+                    r.frequency = 1e9 / mean;
+                    r.jitter = std::chrono::nanoseconds(int64_t(
+                        std::sqrt(std::max(0.0, a.sum_sq / a.ticks - mean * mean))
+                    ));
+                    r.max_jitter = std::chrono::nanoseconds(int64_t(a.max_dev));
+                }
+                return r;
+            }
+            void reset_tick_stats() {
+                auto lck = this->lock<boost::unique_lock<boost::mutex>>();
+                m_TickStats = TickAccum();
+            }
+            
+            CircuitStats stats() const {
+                const auto r = std::memory_order_relaxed;
+                const auto& c = m_Counters;
+                CircuitStats st;
+                st.index = m_Index;
+                st.size = size();
+                st.load = load();
+                st.submitted = m_Submitted.load(r);
+                st.runs = c.runs.load(r);
+                st.completed = c.completed.load(r);
+                st.yields = c.yields.load(r);
+                st.parks = c.parks.load(r);
+                st.steals = c.steals.load(r);
+                st.stolen = m_Stolen.load(r);
+                st.overruns = c.overruns.load(r);
+                st.run_ns = c.run_ns.load(r);
+                for(unsigned i=0;i<TIME_BUCKETS;++i)
+                    st.run_times[i] = c.run_times[i].load(r);
+                return st;
             }
             
         private:
+
+            friend class Multiplexer;
+            friend struct Waiter;
             
-            void stabilize()
+            /*
+             * One round-robin queue per priority class
+             *
+             * pop() takes from the highest priority queue with units in it,
+             *   unless a lower one has been passed over MX_STARVATION
+             *   times in a row, then that one goes first (lowest first)
+             */
+            class RunQueue
             {
-                // WARNING: lock is assumed
-                if(m_Frequency <= MX_EPSILON)
-                    return; // no stabilization
-                const float inv_freq = 1.0f / m_Frequency;
-                if(m_Clock != std::chrono::time_point<std::chrono::system_clock>())
-                {
-                    while(true)
+                public:
+                    
+                    void push_back(std::unique_ptr<Unit> unit) {
+                        auto& q = m_Queues[unit->priority()];
+                        q.push_back(std::move(unit));
+                    }
+                    std::unique_ptr<Unit> pop() {
+                        unsigned pick = NUM_PRIORITIES;
+                        for(unsigned p = NUM_PRIORITIES - 1; p > 0; --p)
+                            if(m_Skipped[p] >= MX_STARVATION && not m_Queues[p].empty()) {
+                                pick = p;
+                                break;
+                            }
+                        if(pick == NUM_PRIORITIES)
+                            for(pick = 0; m_Queues[pick].empty(); ++pick) {}
+                        m_Skipped[pick] = 0;
+                        for(unsigned p = pick + 1; p < NUM_PRIORITIES; ++p)
+                            if(not m_Queues[p].empty())
+                                ++m_Skipped[p];
+                        auto unit = std::move(m_Queues[pick].front());
+                        m_Queues[pick].pop_front();
+                        return unit;
+                    }
+                    
+                    // the unpinned unit closest to the tail of the lowest
+                    //   priority queue
+                    std::unique_ptr<Unit> take_unpinned() {
+                        for(unsigned p = NUM_PRIORITIES; p-- > 0;) {
+                            auto& q = m_Queues[p];
+                            for(auto itr = q.rbegin(); itr != q.rend(); ++itr)
+                            {
+                                if((*itr)->pinned())
+                                    continue;
+                                auto r = std::move(*itr);
+                                q.erase(std::next(itr).base());
+                                return r;
+                            }
+                        }
+                        return std::unique_ptr<Unit>();
+                    }
+                    
+                    bool empty() const {
+                        for(auto&& q: m_Queues)
+                            if(not q.empty())
+                                return false;
+                        return true;
+                    }
+                    size_t size() const {
+                        size_t sz = 0;
+                        for(auto&& q: m_Queues)
+                            sz += q.size();
+                        return sz;
+                    }
+                    void clear() {
+                        for(auto&& q: m_Queues)
+                            q.clear();
+                    }
+                    void swap(RunQueue& rhs) {
+                        for(unsigned p = 0; p < NUM_PRIORITIES; ++p) {
+                            m_Queues[p].swap(rhs.m_Queues[p]);
+                            std::swap(m_Skipped[p], rhs.m_Skipped[p]);
+                        }
+                    }
+                    
+                private:
+                    
+                    std::deque<std::unique_ptr<Unit>> m_Queues[NUM_PRIORITIES];
+                    unsigned m_Skipped[NUM_PRIORITIES] = {};
+            };
+            
+            // shared by the units of a submit_batch_all()
+            struct Batch
+            {
+                explicit Batch(size_t n):
+                    left(n)
+                {}
+                void fail(std::exception_ptr e) {
+                    if(not failed.exchange(true))
+                        error = e;
+                }
+                // the last unit to finish fulfills the promise
+                void done() {
+                    if(left.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                        return;
+                    if(error)
+                        promise.set_exception(error);
+                    else
+                        promise.set_value();
+                }
+                std::atomic<size_t> left;
+                std::atomic<bool> failed = ATOMIC_VAR_INIT(false);
+                std::exception_ptr error;
+                std::promise<void> promise;
+            };
+            
+            // body of a task() unit, kept inside the unit itself
+            template<class T>
+            struct TaskEntry
+            {
+                explicit TaskEntry(Task<T()>&& task):
+                    m_Task(std::move(task))
+                {}
+                TaskEntry(TaskEntry&&) = default;
+                bool operator()() {
+                    return m_Task.poll();
+                }
+                Task<T()> m_Task;
+            };
+            
+            // body of a post() or spawn_detached() unit, which reports
+            //   errors to its handler instead of a promise
+            template<class Func>
+            struct PostEntry
+            {
+                template<class F>
+                PostEntry(F&& func, ErrorHandler&& on_error):
+                    m_Func(std::forward<F>(func)),
+                    m_OnError(std::move(on_error))
+                {}
+                PostEntry(PostEntry&&) = default;
+                // false if cb yielded and needs to run again
+                bool operator()() {
+                    try{
+                        m_Func();
+                    }catch(const kit::yield_exception&){
+                        return false;
+                    }catch(const boost::coroutines::detail::forced_unwind&){
+                        throw;
+                    }catch(...){
+                        if(m_OnError)
+                            m_OnError(std::current_exception());
+                    }
+                    return true;
+                }
+                Func m_Func;
+                ErrorHandler m_OnError;
+            };
+            
+            // body of a coro() unit, moved onto the coroutine's own stack
+            template<class Body>
+            struct CoroEntry
+            {
+                CoroEntry(Body&& body, Unit* unit):
+                    m_Body(std::move(body)),
+                    m_pUnit(unit)
+                {}
+                CoroEntry(CoroEntry&&) = default;
+                void operator()(pull_coro_t& sink) {
+                    m_pUnit->m_pPull = &sink;
+                    run(m_Body, sink);
+                }
+                template<class T>
+                static void run(Task<T()>& task, pull_coro_t&) {
+                    task();
+                }
+                // throwing kit::yield_exception suspends and retries
+                template<class Func>
+                static void run(PostEntry<Func>& entry, pull_coro_t& sink) {
+                    while(not entry())
+                        sink();
+                }
+                Body m_Body;
+                Unit* m_pUnit;
+            };
+
+            template<class T, class Func>
+            std::unique_ptr<Unit> task_unit(
+                std::function<bool()> cond,
+                Func&& cb,
+                unsigned flags,
+                std::future<T>& fut
+            ) {
+                auto cbt = Task<T()>(std::forward<Func>(cb));
+                fut = cbt.get_future();
+                return kit::make_unique<Unit>(
+                    std::move(cond),
+                    TaskEntry<T>(std::move(cbt)),
+                    flags
+                );
+            }
+            
+            template<class T, class Func>
+            std::unique_ptr<Unit> coro_unit(
+                Func&& cb,
+                unsigned flags,
+                std::future<T>& fut
+            ) {
+                auto cbt = Task<T()>(std::forward<Func>(cb));
+                fut = cbt.get_future();
+                return coro_unit(std::move(cbt), flags);
+            }
+            
+            // Body is called once on the coroutine, like a Task
+            template<class Body>
+            std::unique_ptr<Unit> coro_unit(Body&& body, unsigned flags) {
+                // units are heap-allocated (pooled) so their address
+                //   survives being stolen by another circuit
+                auto unit = kit::make_unique<Unit>(
+                    std::function<bool()>(),
+                    UnitFunc(),
+                    flags
+                );
+                auto& stacks = m_pMultiplexer->m_Stacks;
+                unit->m_Push = push_coro_t(
+                    CoroEntry<Body>(std::move(body), unit.get()),
+                    boost::coroutines::attributes(stacks.stack_size()),
+                    stacks.get_allocator()
+                );
+                auto* coroptr = &unit->m_Push;
+                unit->m_Func = [coroptr]{
+                    (*coroptr)();
+                    return not *coroptr; // completed?
+                };
+                return unit;
+            }
+            
+            // hands a unit to this circuit without taking the circuit lock,
+            //   so producers never contend with the circuit thread
+            // returns false if the circuit was still full by deadline
+            bool enqueue(
+                std::unique_ptr<Unit> unit,
+                std::chrono::steady_clock::time_point deadline =
+                    std::chrono::steady_clock::time_point::max()
+            ) {
+                if(not reserve(1, deadline))
+                    return false;
+                m_Submitted.fetch_add(1, std::memory_order_relaxed);
+                m_Inbox.push(unit.release());
+                notify();
+                on_enqueue();
+                return true;
+            }
+
+            // publishes units as chains, as large as the buffer allows
+            void enqueue(std::vector<std::unique_ptr<Unit>>& units) {
+                size_t i = 0;
+                while(i < units.size()) {
+                    const size_t n = reserve(units.size() - i);
+                    Unit* first = units[i].get();
+                    Unit* last = units[i + n - 1].get();
+                    for(size_t j = i; j < i + n; ++j) {
+                        if(j + 1 < i + n)
+                            units[j]->m_pNext.store(
+                                units[j + 1].get(), std::memory_order_relaxed
+                            );
+                        units[j].release();
+                    }
+                    m_Submitted.fetch_add(n, std::memory_order_relaxed);
+                    m_Inbox.push(first, last);
+                    notify();
+                    i += n;
+                }
+                on_enqueue();
+            }
+
+            // claims room for up to n more units (at least one), waiting
+            //   while buffer is full, returns how many were claimed
+            //   (0 if the buffer was still full by deadline)
+            size_t reserve(
+                size_t n = 1,
+                std::chrono::steady_clock::time_point deadline =
+                    std::chrono::steady_clock::time_point::max()
+            ) {
+                size_t sz = m_Size;
+                while(true) {
+                    boost::this_thread::interruption_point();
+                    const size_t buffered = m_Buffered;
+                    size_t claim = n;
+                    // tasks running here can't wait for themselves to finish
+                    if(buffered && not blocks_self()) {
+                        if(sz >= buffered) {
+                            if(not wait_not_full(deadline))
+                                return 0;
+                            sz = m_Size;
+                            continue;
+                        }
+                        claim = std::min(n, buffered - sz);
+                    }
+                    if(m_Size.compare_exchange_weak(sz, sz + claim))
+                        return claim;
+                }
+            }
+            
+            // true if called by a task (not a coroutine) on this circuit
+            bool blocks_self() const {
+                if(current() != this)
+                    return false;
+                Unit* unit = m_pCurrentUnit;
+                return not unit || not unit->m_pPull;
+            }
+            bool full() const {
+                const size_t buffered = m_Buffered;
+                return buffered && m_Size >= buffered;
+            }
+            
+            // wait for a unit to leave this circuit, false on timeout
+            // coroutines (of this multiplexer) park, anything else blocks
+            bool wait_not_full(std::chrono::steady_clock::time_point deadline) {
+                typedef std::chrono::steady_clock clock;
+                if(clock::now() >= deadline)
+                    return false;
+                Circuit* circuit = m_pMultiplexer->try_this_circuit();
+                auto waiter = circuit ?
+                    circuit->prepare_wait() : std::shared_ptr<Waiter>();
+                if(waiter) {
                     {
-                        auto now = std::chrono::system_clock::now();
-                        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
-                            (now - m_Clock).count() * 0.001f;
-                        if(elapsed < inv_freq) // in seconds
+                        std::unique_lock<std::mutex> l(m_FullMutex);
+                        // drop registrations that have already resumed
+                        while(not m_FullWaiters.empty() &&
+                            not m_FullWaiters.front()->pending())
                         {
-                            auto lck = this->lock<boost::unique_lock<boost::mutex>>(boost::defer_lock);
-                            if(not lck.try_lock())
-                                break;
-                            m_CondVar.timed_wait(lck, boost::posix_time::milliseconds(
-                                int((inv_freq - elapsed)*1000.0f)
-                            ));
+                            m_FullWaiters.pop_front();
                         }
-                        else
-                            break;
+                        m_FullWaiters.push_back(waiter);
+                        ++m_NumBlocked;
+                    }
+                    // re-check now that not_full() can see us
+                    if(full()) {
+                        if(deadline != clock::time_point::max())
+                            circuit->add_timer(deadline, waiter);
+                        circuit->park();
+                    } else
+                        circuit->cancel_wait();
+                    --m_NumBlocked;
+                    return not full() || clock::now() < deadline;
+                }
+                std::unique_lock<std::mutex> l(m_FullMutex);
+                ++m_NumBlocked;
+                auto room = [this]{ return not full(); };
+                bool r = true;
+                if(deadline == clock::time_point::max())
+                    m_NotFull.wait(l, room);
+                else
+                    r = m_NotFull.wait_until(l, deadline, room);
+                --m_NumBlocked;
+                return r;
+            }
+            
+            // units finished or left this circuit
+            void release(size_t n = 1) {
+                m_Size -= n;
+                // pairs with ++m_NumBlocked before the producer re-checks
+                if(m_NumBlocked)
+                    not_full();
+            }
+            // wake everyone waiting for room, they'll race for it
+            void not_full() {
+                std::deque<std::shared_ptr<Waiter>> waiters;
+                {
+                    std::unique_lock<std::mutex> l(m_FullMutex);
+                    waiters.swap(m_FullWaiters);
+                    m_NotFull.notify_all();
+                }
+                for(auto&& w: waiters)
+                    Waiter::notify(w);
+            }
+
+            // m_Timers is also filled by thieves draining when_at() units
+            //   in surrender(), so it's only touched under the lock
+            void add_timer(
+                std::chrono::steady_clock::time_point deadline,
+                std::shared_ptr<Waiter> waiter
+            ){
+                auto l = this->lock<boost::unique_lock<boost::mutex>>();
+                m_Timers.add(deadline, std::move(waiter));
+            }
+
+            // called by whoever won the race to wake a parked unit
+            void wake(std::shared_ptr<Waiter> waiter) {
+                Waiter* w = waiter.get();
+                w->m_pSelf = std::move(waiter); // keep alive while queued
+                m_Wakeups.push(w);
+                notify();
+            }
+
+            // wake up the circuit thread if it is sleeping
+            void notify() {
+                // pairs with the fence in sleep(), so either we see the
+                //   circuit sleeping or it sees our unit in the inbox
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(m_bSleeping)
+                    wakeup();
+            }
+            void wakeup() {
+                {
+                    auto l = this->lock<boost::unique_lock<boost::mutex>>();
+                    m_CondVar.notify_one();
+                }
+                m_Reactor.interrupt(); // in case we're waiting on fds
+            }
+            
+            // let idle circuits know there is something to steal
+            void on_enqueue() {
+                if(m_pMultiplexer->stealing())
+                    m_pMultiplexer->wake_idle(this);
+            }
+
+            // WARNING: lock is assumed for all functions below
+            
+            // move units from the lock-free inbox to the run queue
+            // (inbox consumers are serialized by the circuit lock)
+            void drain() {
+                while(Unit* unit = m_Inbox.pop()) {
+                    if(unit->m_Deadline != std::chrono::steady_clock::time_point())
+                        schedule(std::unique_ptr<Unit>(unit));
+                    else
+                        m_Units.push_back(std::unique_ptr<Unit>(unit));
+                }
+                while(Waiter* w = m_Wakeups.pop()) {
+                    auto waiter = std::move(w->m_pSelf);
+                    auto itr = m_Parked.find(waiter->m_pUnit);
+                    if(itr == m_Parked.end() || itr->second->m_pWaiter != waiter)
+                        continue; // stale
+                    waiter->done();
+                    itr->second->m_pWaiter.reset();
+                    m_Units.push_back(std::move(itr->second));
+                    m_Parked.erase(itr);
+                    parked_changed();
+                }
+            }
+            
+            // park a when_at() unit until its deadline
+            void schedule(std::unique_ptr<Unit> unit) {
+                Unit* u = unit.get();
+                auto deadline = u->m_Deadline;
+                u->m_Deadline = std::chrono::steady_clock::time_point();
+                u->m_pWaiter = std::make_shared<Waiter>(this, u);
+                u->m_pWaiter->park();
+                m_Timers.add(deadline, u->m_pWaiter);
+                m_Parked[u] = std::move(unit);
+                parked_changed();
+                // (notifying our own waiter doesn't take the lock)
+                if(u->m_pGroup)
+                    u->m_pGroup->watch(u->m_pWaiter);
+            }
+            void parked_changed() {
+                m_NumParked.store(m_Parked.size(), std::memory_order_relaxed);
+            }
+            
+            // wake units whose timers ran out, returns true if any did
+            bool expire() {
+                if(m_Timers.empty())
+                    return false;
+                bool woke = false;
+                m_Timers.advance(std::chrono::steady_clock::now(),
+                    [&woke](std::shared_ptr<Waiter>& waiter) {
+                        if(Waiter::notify(waiter))
+                            woke = true;
+                    }
+                );
+                return woke;
+            }
+            
+            // how long an idle circuit can sleep before the next timer,
+            //   capped at max
+            template<class Duration>
+            boost::chrono::nanoseconds until_timer(Duration max) const {
+                auto d = std::chrono::nanoseconds(max);
+                if(not m_Timers.empty()) {
+                    d = std::min(d, std::max(std::chrono::nanoseconds(0),
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            m_Timers.next_expiry() - std::chrono::steady_clock::now()
+                        )
+                    ));
+                }
+                return boost::chrono::nanoseconds(d.count());
+            }
+            bool idle() const {
+                return m_Inbox.empty() && m_Wakeups.empty();
+            }
+
+            // wait for notify() or an optional timeout
+            // (or for an fd to become ready, if any coroutines are waiting)
+            void sleep(boost::unique_lock<boost::mutex>& lck) {
+                if(not m_Reactor.empty() && m_Parked.empty())
+                    prune_io(); // so we don't sleep on fds nobody wants
+                m_bSleeping = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(idle()) {
+                    if(m_Reactor.empty())
+                        m_CondVar.wait(lck);
+                    else
+                        poll_io(lck, -1);
+                }
+                m_bSleeping = false;
+                wake_io();
+            }
+            template<class Duration>
+            void sleep(boost::unique_lock<boost::mutex>& lck, Duration d) {
+                if(not m_Reactor.empty() && m_Parked.empty())
+                    prune_io();
+                m_bSleeping = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(idle()) {
+                    if(m_Reactor.empty())
+                        m_CondVar.wait_for(lck, d);
+                    else {
+                        // round up to epoll's resolution
+                        const auto ns = boost::chrono::duration_cast<
+                            boost::chrono::nanoseconds
+                        >(d).count();
+                        poll_io(lck, int(std::min<decltype(ns)>(
+                            (ns + 999999) / 1000000, INT_MAX
+                        )));
+                    }
+                }
+                m_bSleeping = false;
+                wake_io();
+            }
+            
+            // drop reactor waiters whose units don't want them anymore
+            void prune_io() {
+                m_Reactor.prune([](std::shared_ptr<Waiter>& w) {
+                    return not w->pending();
+                });
+                m_IoPrune = std::max(size_t(MIN_IO_PRUNE), m_Reactor.size() * 2);
+            }
+            
+            // wait on the reactor, collecting the waiters that are ready
+            void poll_io(boost::unique_lock<boost::mutex>& lck, int timeout_ms) {
+                lck.unlock();
+                m_Reactor.poll(timeout_ms, [this](std::shared_ptr<Waiter>& w) {
+                    m_IoReady.push_back(std::move(w));
+                });
+                lck.lock();
+            }
+            // wake the coroutines whose fds are ready
+            // returns true if any did
+            bool wake_io() {
+                bool woke = false;
+                for(auto&& w: m_IoReady)
+                    if(Waiter::notify(w))
+                        woke = true;
+                m_IoReady.clear();
+                return woke;
+            }
+            // check fds without blocking while the circuit is busy
+            bool io() {
+                if(m_Reactor.empty())
+                    return false;
+                m_Reactor.poll(0, [this](std::shared_ptr<Waiter>& w) {
+                    m_IoReady.push_back(std::move(w));
+                });
+                return wake_io();
+            }
+
+            // called by an idle circuit looking for work
+            // gives up the unit closest to the tail of our lowest priority
+            //   queue, skipping pinned units
+            std::unique_ptr<Unit> surrender() {
+                auto lck = this->lock<boost::unique_lock<boost::mutex>>(boost::try_to_lock);
+                if(not lck.owns_lock())
+                    return std::unique_ptr<Unit>();
+                drain();
+                // leave our last unit alone unless we're busy with another
+                if(m_Units.empty() || (m_Units.size() == 1 && not m_pCurrentUnit))
+                    return std::unique_ptr<Unit>();
+                auto r = m_Units.take_unpinned();
+                if(r) {
+                    m_Stolen.fetch_add(1, std::memory_order_relaxed);
+                    release();
+                }
+                return r;
+            }
+            
+            // keeps ticks on a fixed schedule of frequency() per second
+            void stabilize(boost::unique_lock<boost::mutex>& lck)
+            {
+                typedef std::chrono::steady_clock clock;
+                if(m_Period == clock::duration::zero())
+                    return; // no stabilization
+                auto now = clock::now();
+                if(m_NextTick == clock::time_point()) {
+                    // first tick since we were idle
+                    m_NextTick = now + m_Period;
+                    m_LastTick = now;
+                    return;
+                }
+                if(now < m_NextTick) {
+                    wait_tick(lck, m_NextTick);
+                    now = clock::now();
+                }
+                record_tick(now - m_LastTick);
+                m_LastTick = now;
+                // stay on schedule unless we fell a whole tick behind
+                m_NextTick += m_Period;
+                if(m_NextTick < now)
+                    m_NextTick = now + m_Period;
+            }
+            
+            // sleep until the next tick is due (new units cut this short)
+            // HYBRID wakes up early by however late sleeps have been
+            //   waking up lately and spins the rest of the way
+            void wait_tick(
+                boost::unique_lock<boost::mutex>& lck,
+                std::chrono::steady_clock::time_point deadline
+            ){
+                typedef std::chrono::steady_clock clock;
+                const bool spin = (m_Stabilizer == HYBRID);
+                const auto wake = spin ? deadline - m_SpinMargin : deadline;
+                auto now = clock::now();
+                if(wake > now) {
+                    sleep(lck, boost::chrono::nanoseconds(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            wake - now
+                        ).count()
+                    ));
+                    if(not idle())
+                        return;
+                    now = clock::now();
+                    if(spin && now >= wake) {
+                        // aim for twice the recent oversleep
+                        m_SpinMargin += ((now - wake) * 2 - m_SpinMargin) / 8;
+                        m_SpinMargin = std::max(m_SpinMargin,
+                            clock::duration(std::chrono::microseconds(10)));
+                        m_SpinMargin = std::min(m_SpinMargin, m_Period);
                     }
                 }
-                m_Clock = std::chrono::system_clock::now();
+                if(spin) {
+                    lck.unlock();
+                    while(clock::now() < deadline && idle())
+                        boost::this_thread::yield();
+                    lck.lock();
+                }
+            }
+            void record_tick(std::chrono::steady_clock::duration period) {
+                const double ns = double(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(period).count()
+                );
+                const double target = double(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(m_Period).count()
+                );
+                auto& a = m_TickStats;
+                ++a.ticks;
+                a.sum += ns;
+                a.sum_sq += ns * ns;
+                a.max_dev = std::max(a.max_dev, std::abs(ns - target));
+            }
+            
+            // counters with a single writer (this thread) don't need
+            //   a locked increment
+            static void bump(std::atomic<uint64_t>& n, uint64_t by = 1) {
+                n.store(n.load(std::memory_order_relaxed) + by,
+                    std::memory_order_relaxed);
+            }
+            void record_run(std::chrono::steady_clock::duration d) {
+                const uint64_t ns = std::max<int64_t>(0,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()
+                );
+                bump(m_Counters.run_ns, ns);
+                unsigned bucket = 0;
+                for(uint64_t us = ns / 1000; us && bucket < TIME_BUCKETS - 1; us >>= 1)
+                    ++bucket;
+                bump(m_Counters.run_times[bucket]);
+            }
+            
+            void on_overrun(std::chrono::steady_clock::duration d) {
+                bump(m_Counters.overruns);
+                auto cb = m_pMultiplexer->overrun_handler();
+                if(cb)
+                    cb(m_Index, std::chrono::duration_cast<std::chrono::nanoseconds>(d));
             }
             
             // returns false only on empty() && m_Finish
-            virtual bool next(unsigned& idx) {
+            virtual bool next() {
                 auto lck = this->lock<boost::unique_lock<boost::mutex>>();
-                //if(l.try_lock())
                 // wait until task queued or thread interrupt
+                bool steal = true;
                 while(true){
                     boost::this_thread::interruption_point();
+                    drain();
                     if(not m_Units.empty())
                         break;
-                    else if(m_Finish) // finished AND empty
+                    else if(m_Finish && m_Size == 0) // finished AND empty
                         return false;
-                    m_CondVar.wait(lck);
-                    boost::this_thread::yield();
-                    continue;
+                    m_NextTick = std::chrono::steady_clock::time_point();
+                    if(expire())
+                        continue;
+                    if(m_pMultiplexer->stealing()) {
+                        if(steal) {
+                            steal = false;
+                            lck.unlock();
+                            auto unit = m_pMultiplexer->steal(this);
+                            lck.lock();
+                            if(unit) {
+                                ++m_Size;
+                                bump(m_Counters.steals);
+                                m_Units.push_back(std::move(unit));
+                            }
+                            continue;
+                        }
+                        // nothing to steal, wait for busy circuits to wake us
+                        m_bIdle = true;
+                        sleep(lck, until_timer(
+                            std::chrono::microseconds(MX_STEAL_INTERVAL)
+                        ));
+                        m_bIdle = false;
+                        steal = true;
+                        continue;
+                    }
+                    if(m_Timers.empty())
+                        sleep(lck);
+                    else
+                        sleep(lck, until_timer(std::chrono::hours(1)));
                 }
                 
-                if(idx >= m_Units.size()) {
-                    stabilize();
-                    idx = 0;
+                if(not m_PassLeft) {
+                    // made a full pass through the run queue
+                    if(expire() | io())
+                        drain();
+                    stabilize(lck);
+                    m_PassLeft = m_Units.size();
+                    if(not m_PassLeft)
+                        return true;
                 }
+                --m_PassLeft;
                 
-                auto& task = m_Units[idx];
-                if(!task.m_Ready || task.m_Ready()) {
+                auto unit = m_Units.pop();
+                if(unit->cancelled()) {
+                    // destroyed outside the lock, unwinding may submit work
                     lck.unlock();
-                    m_pCurrentUnit = &m_Units[idx];
-                    try{
-                        task.m_Func();
-                    }catch(const kit::yield_exception&){
-                        lck.lock();
-                        const size_t sz = m_Units.size();
-                        idx = std::min<unsigned>(idx+1, sz);
-                        if(idx == sz) {
-                            stabilize();
-                            idx = 0;
-                        }
+                    unit.reset();
+                    release();
+                    return true;
+                }
+                if(unit->m_Ready && not unit->m_Ready()) {
+                    m_Units.push_back(std::move(unit));
+                    return true;
+                }
+                
+                m_pCurrentUnit = unit.get();
+                lck.unlock();
+                typedef std::chrono::steady_clock clock;
+                const bool timed = m_pMultiplexer->timing();
+                const auto slice = m_pMultiplexer->time_slice();
+                const auto overrun = m_pMultiplexer->overrun();
+                clock::time_point t0;
+                if(timed || slice.count() || overrun.count())
+                    t0 = clock::now();
+                m_SliceEnd = slice.count() ? t0 + slice : clock::time_point::max();
+                const bool done = unit->m_Func();
+                if(timed || overrun.count()) {
+                    const auto d = clock::now() - t0;
+                    if(timed)
+                        record_run(d);
+                    if(overrun.count() && d > overrun)
+                        on_overrun(d);
+                }
+                m_pCurrentUnit = nullptr;
+                bump(m_Counters.runs);
+                if(done) {
+                    bump(m_Counters.completed);
+                    unit.reset();
+                    release();
+                    return true;
+                }
+                // m_Parked and m_Wakeups are shared with thieves draining
+                //   us in surrender(), and parking under the lock means a
+                //   notify can't be drained (and dropped as stale) before
+                //   the unit is in m_Parked
+                lck.lock();
+                if(unit->m_bPark) {
+                    unit->m_bPark = false;
+                    // only park if nobody notified us since prepare_wait()
+                    if(unit->m_pWaiter->park()) {
+                        bump(m_Counters.parks);
+                        Unit* u = unit.get();
+                        m_Parked[u] = std::move(unit);
+                        parked_changed();
+                        if(u->m_pGroup)
+                            u->m_pGroup->watch(u->m_pWaiter);
                         return true;
                     }
-                    m_pCurrentUnit = nullptr;
-                    lck.lock();
-                    m_Units.erase(m_Units.begin() + idx);
                 }
+                bump(m_Counters.yields);
+                m_Units.push_back(std::move(unit));
                 return true;
             }
             
-            Unit* m_pCurrentUnit = nullptr;
-            std::deque<Unit> m_Units;
+            std::atomic<Unit*> m_pCurrentUnit = ATOMIC_VAR_INIT(nullptr);
+            // new units from any thread, drained into m_Units by circuit
+            kit::mpsc_queue<Unit> m_Inbox;
+            RunQueue m_Units;
+            // notified waiters from any thread, see wake()
+            kit::mpsc_queue<Waiter> m_Wakeups;
+            // units waiting to be woken up, only touched under the lock
+            //   (by the circuit thread, or a thief in surrender())
+            std::unordered_map<Unit*, std::unique_ptr<Unit>> m_Parked;
+            std::atomic<size_t> m_NumParked = ATOMIC_VAR_INIT(0);
+            // deadlines of parked units, only touched under the lock
+            kit::timer_wheel<std::shared_ptr<Waiter>> m_Timers;
+            // fds that parked units are waiting on, same as above
+            kit::reactor<std::shared_ptr<Waiter>> m_Reactor;
+            std::vector<std::shared_ptr<Waiter>> m_IoReady;
+            // reactor size that triggers the next prune_io()
+            static const size_t MIN_IO_PRUNE = 16;
+            size_t m_IoPrune = MIN_IO_PRUNE;
+            size_t m_PassLeft = 0;
+            // when the running unit's time slice is up, see maybe_yield()
+            std::chrono::steady_clock::time_point m_SliceEnd =
+                std::chrono::steady_clock::time_point::max();
+            // units owned by this circuit (inbox, queue and running)
+            std::atomic<size_t> m_Size = ATOMIC_VAR_INIT(0);
+            // producers waiting for room in a full buffer
+            std::mutex m_FullMutex;
+            std::condition_variable m_NotFull;
+            std::deque<std::shared_ptr<Waiter>> m_FullWaiters;
+            std::atomic<size_t> m_NumBlocked = ATOMIC_VAR_INIT(0);
             boost::thread m_Thread;
-            size_t m_Buffered = 0;
+            std::atomic<size_t> m_Buffered = ATOMIC_VAR_INIT(0);
             std::atomic<bool> m_Finish = ATOMIC_VAR_INIT(false);
+            std::atomic<bool> m_bIdle = ATOMIC_VAR_INIT(false);
+            std::atomic<bool> m_bSleeping = ATOMIC_VAR_INIT(false);
             Multiplexer* m_pMultiplexer;
             unsigned m_Index=0;
+            // pinned to these, or unpinned if empty
+            std::vector<unsigned> m_Cpus;
             boost::condition_variable m_CondVar;
-            std::chrono::time_point<std::chrono::system_clock> m_Clock;
-            float m_Frequency = 1.0f * MX_FREQ;
+            // tick period in nanoseconds, summed for TickStats
+            struct TickAccum
+            {
+                size_t ticks = 0;
+                double sum = 0.0;
+                double sum_sq = 0.0;
+                double max_dev = 0.0;
+            };
+            float m_Frequency = 0.0f;
+            Stabilizer m_Stabilizer = MX_STABILIZER;
+            std::chrono::steady_clock::duration m_Period{0};
+            std::chrono::steady_clock::duration m_SpinMargin{0};
+            std::chrono::steady_clock::time_point m_NextTick;
+            std::chrono::steady_clock::time_point m_LastTick;
+            TickAccum m_TickStats;
+            
+            // see CircuitStats, padded so that updating them doesn't
+            //   slow down whatever else shares their cache lines
+            struct Counters
+            {
+                Counters() {
+                    runs = completed = yields = parks = steals = run_ns = 0;
+                    overruns = 0;
+                    for(auto&& n: run_times)
+                        n = 0;
+                }
+                std::atomic<uint64_t> runs, completed, yields, parks, steals;
+                std::atomic<uint64_t> run_ns, overruns;
+                std::atomic<uint64_t> run_times[TIME_BUCKETS];
+            };
+            volatile int8_t m_CountersPad[CACHE_LINE_SIZE];
+            // only written by the circuit thread
+            Counters m_Counters;
+            volatile int8_t m_SharedCountersPad[CACHE_LINE_SIZE];
+            // written by other threads
+            std::atomic<uint64_t> m_Submitted = ATOMIC_VAR_INIT(0);
+            std::atomic<uint64_t> m_Stolen = ATOMIC_VAR_INIT(0);
+            volatile int8_t m_CountersEndPad[CACHE_LINE_SIZE];
         };
         
         friend class Circuit;
+
+        /*
+         * Handshake between a parked unit and whatever will wake it up
+         * (WaitList, timers, ...), shared so that stale registrations
+         *   can outlive the unit harmlessly
+         */
+        struct Waiter:
+            public kit::mpsc_node
+        {
+            enum State {
+                WAITING, // registered, unit still running
+                PARKED, // unit suspended by its circuit
+                NOTIFIED,
+                DONE // unit resumed or stopped waiting
+            };
+
+            Waiter(Circuit* circuit, Unit* unit):
+                m_pCircuit(circuit),
+                m_pUnit(unit)
+            {}
+
+            // returns false if the waiter was stale or already notified
+            static bool notify(const std::shared_ptr<Waiter>& waiter) {
+                unsigned state = WAITING;
+                if(waiter->m_State.compare_exchange_strong(state, NOTIFIED))
+                    return true; // circuit will see this instead of parking
+                if(state == PARKED &&
+                    waiter->m_State.compare_exchange_strong(state, NOTIFIED)
+                ){
+                    waiter->m_pCircuit->wake(waiter);
+                    return true;
+                }
+                return false;
+            }
+            bool pending() const {
+                unsigned state = m_State;
+                return state == WAITING || state == PARKED;
+            }
+
+        private:
+
+            friend class Circuit;
+            friend struct Unit;
+
+            bool park() {
+                unsigned state = WAITING;
+                return m_State.compare_exchange_strong(state, PARKED);
+            }
+            void done() {
+                m_State = DONE;
+            }
+
+            std::atomic<unsigned> m_State = ATOMIC_VAR_INIT(WAITING);
+            Circuit* const m_pCircuit;
+            Unit* const m_pUnit;
+            std::shared_ptr<Waiter> m_pSelf;
+        };
+
+        // RAII helper for AWAIT_ON()
+        class Waiting
+        {
+            public:
+                Waiting(Multiplexer* mx, WaitList* list):
+                    m_pMultiplexer(mx),
+                    m_pList(list)
+                {}
+                Waiting(Waiting&&) = default;
+                Waiting(const Waiting&) = delete;
+                Waiting& operator=(const Waiting&) = delete;
+                ~Waiting() {
+                    Circuit* circuit = m_pMultiplexer->try_this_circuit();
+                    if(m_bRegistered && circuit)
+                        circuit->cancel_wait();
+                }
+                // call each time the awaited expression yields
+                void next();
+            private:
+                Multiplexer* m_pMultiplexer;
+                WaitList* m_pList;
+                bool m_bRegistered = false;
+        };
+        Waiting waiting(WaitList& list) {
+            return Waiting(this, &list);
+        }
         
-        Multiplexer(bool init_now=true):
+        // concurrency of 0 means one circuit per hardware thread
+        Multiplexer(bool init_now=true, unsigned concurrency=MX_THREADS):
             m_Concurrency(std::max<unsigned>(1U,
-                MX_THREADS ? MX_THREADS :
+                concurrency ? concurrency :
                     boost::thread::hardware_concurrency()
             ))
         {
@@ -439,10 +2056,12 @@ class Multiplexer:
             finish();
         }
         void init() {
+            m_Circuits.reserve(m_Concurrency);
             for(unsigned i=0;i<m_Concurrency;++i)
                 m_Circuits.emplace_back(make_tuple(
                     kit::make_unique<Circuit>(this, i), CacheLinePadding()
                 ));
+            m_bInit = true;
             //m_MultiCircuit = kit::make_unique<Circuit>(this, i);
         }
         //void join() {
@@ -454,9 +2073,152 @@ class Multiplexer:
                 std::get<0>(s)->stop();
         }
 
+        // pick a circuit for new work according to placement()
         Circuit& any_circuit(){
-            // TODO: load balancing would be nice here
-            return *std::get<0>((m_Circuits[std::rand() % m_Concurrency]));
+            return any_circuit(m_Placement);
+        }
+        Circuit& any_circuit(Placement p){
+            switch(p) {
+                case ROUND_ROBIN:
+                    return circuit(m_NextCircuit.fetch_add(1, std::memory_order_relaxed));
+                case LEAST_QUEUED: {
+                    unsigned best = 0;
+                    size_t best_load = circuit(0).load();
+                    for(unsigned i=1;i<m_Concurrency && best_load;++i) {
+                        const size_t load = circuit(i).load();
+                        if(load < best_load) {
+                            best = i;
+                            best_load = load;
+                        }
+                    }
+                    return circuit(best);
+                }
+                case POWER_OF_TWO: {
+                    if(m_Concurrency == 1)
+                        return circuit(0);
+                    const unsigned a = random() % m_Concurrency;
+                    // any other circuit, so the two choices are distinct
+                    const unsigned b = (a + 1 + random() % (m_Concurrency - 1))
+                        % m_Concurrency;
+                    return circuit(a).load() <= circuit(b).load() ?
+                        circuit(a) : circuit(b);
+                }
+                case RANDOM:
+                default:
+                    return circuit(random() % m_Concurrency);
+            }
+        }
+
+        // Circuit::post() and spawn_detached() on any_circuit()
+        template<class Func>
+        void post(
+            Func&& cb,
+            unsigned flags = 0,
+            ErrorHandler on_error = ErrorHandler()
+        ) {
+            any_circuit().post(
+                std::forward<Func>(cb), flags, std::move(on_error)
+            );
+        }
+        template<class Func>
+        void spawn_detached(
+            Func&& cb,
+            unsigned flags = 0,
+            ErrorHandler on_error = ErrorHandler()
+        ) {
+            any_circuit().spawn_detached(
+                std::forward<Func>(cb), flags, std::move(on_error)
+            );
+        }
+
+        void placement(Placement p) {
+            m_Placement = p;
+        }
+        Placement placement() const {
+            return m_Placement;
+        }
+        
+        // repins every circuit, returns false if any of them failed
+        bool affinity(Affinity a) {
+            m_Affinity = a;
+            bool r = true;
+            for(unsigned i=0;i<m_Circuits.size();++i)
+                if(not circuit(i).pin(cpus(i, a)))
+                    r = false;
+            return r;
+        }
+        Affinity affinity() const {
+            return m_Affinity;
+        }
+        // where affinity a puts circuit idx (empty for AFFINITY_NONE)
+        static std::vector<unsigned> cpus(unsigned idx, Affinity a) {
+            if(a == AFFINITY_NONE)
+                return std::vector<unsigned>();
+            const auto order = kit::cpu_order();
+            const unsigned cpu = order[idx % order.size()];
+            if(a == AFFINITY_NODE)
+                return kit::cpu_node(cpu);
+            return std::vector<unsigned>(1, cpu);
+        }
+        
+        // a snapshot of every circuit's CircuitStats
+        std::vector<CircuitStats> stats() {
+            std::vector<CircuitStats> r;
+            r.reserve(m_Circuits.size());
+            for(unsigned i=0;i<m_Circuits.size();++i)
+                r.push_back(circuit(i).stats());
+            return r;
+        }
+        // time units for CircuitStats::run_ns and run_times
+        void timing(bool b) {
+            m_bTiming = b;
+        }
+        bool timing() const {
+            return m_bTiming;
+        }
+        
+        // how long a unit may run before maybe_yield() yields (0 is forever)
+        void time_slice(std::chrono::nanoseconds d) {
+            m_TimeSlice = d.count();
+        }
+        std::chrono::nanoseconds time_slice() const {
+            return std::chrono::nanoseconds(m_TimeSlice.load(std::memory_order_relaxed));
+        }
+        // count runs longer than threshold in CircuitStats::overruns and
+        //   pass them to cb, if any (0 turns this off)
+        // cb runs on the overrunning circuit and must not throw
+        void overrun(
+            std::chrono::nanoseconds threshold,
+            OverrunHandler cb = OverrunHandler()
+        ) {
+            {
+                std::unique_lock<std::mutex> l(m_OverrunMutex);
+                m_OnOverrun = std::move(cb);
+            }
+            m_Overrun = threshold.count();
+        }
+        std::chrono::nanoseconds overrun() const {
+            return std::chrono::nanoseconds(m_Overrun.load(std::memory_order_relaxed));
+        }
+        OverrunHandler overrun_handler() {
+            std::unique_lock<std::mutex> l(m_OverrunMutex);
+            return m_OnOverrun;
+        }
+        
+        // work stealing: idle circuits take unpinned units from busy ones
+        void stealing(bool b) {
+            m_bStealing = b;
+        }
+        bool stealing() const {
+            return m_bStealing;
+        }
+        
+        // stack size of coroutines created from now on (0 is the default)
+        void stack_size(size_t sz) {
+            m_Stacks.stack_size(sz);
+        }
+        size_t stack_size() const {
+            return m_Stacks.stack_size();
         }
         
         Circuit& circuit(unsigned idx) {
@@ -467,34 +2229,93 @@ class Multiplexer:
         }
         
         void yield(){
-            try{
-                this_circuit().yield();
-            }catch(const std::out_of_range&){
+            Circuit* circuit = try_this_circuit();
+            if(not circuit)
                 throw kit::yield_exception();
-            }
+            circuit->yield();
+        }
+        /*
+         * Runs cb on a separate pool of threads (up to MX_BLOCKING_THREADS)
+         *   and returns its result, for blocking calls that would stall
+         *   every other unit on the circuit
+         *
+         * Coroutines park in the meantime and resume on their own
+         *   circuit, anything else (including tasks) waits for it
+         */
+        template<class Func>
+        auto blocking(Func cb) -> decltype(cb()) {
+            typedef decltype(cb()) R;
+            auto p = std::make_shared<kit::promise<R>>();
+            auto fut = p->get_future();
+            Circuit* circuit = try_this_circuit();
+            auto waiter = circuit ?
+                circuit->prepare_wait() : std::shared_ptr<Waiter>();
+            m_Blocking.post([p, cb, waiter]() mutable {
+                try{
+                    kit::detail::invoke<R>::attempt(*p, cb);
+                }catch(...){ // nobody to retry a yield here
+                    p->set_exception(std::current_exception());
+                }
+                if(waiter)
+                    Waiter::notify(waiter);
+            });
+            if(waiter)
+                circuit->park();
+            return fut.get();
+        }
+        
+        // true if the running unit's TaskGroup has been cancelled
+        bool cancelled(){
+            Circuit* circuit = try_this_circuit();
+            Unit* unit = circuit ? circuit->this_unit() : nullptr;
+            return unit && unit->cancelled();
+        }
+        // see Circuit::maybe_yield(), never yields outside of circuits
+        bool maybe_yield(){
+            Circuit* circuit = try_this_circuit();
+            return circuit && circuit->maybe_yield();
         }
 
         static void sleep(std::chrono::milliseconds ms) {
             if(ms == std::chrono::milliseconds(0))
                 return;
-            auto t0 = std::chrono::steady_clock::now();
-            while(true) {
-                auto t1 = std::chrono::steady_clock::now();
-                if(std::chrono::duration_cast<std::chrono::milliseconds>(
-                    t1 - t0
-                ) >= ms) {
-                    break;
-                }
-                YIELD();
-            }
+            MX.sleep_for(ms);
+        }
+        
+        // coroutines are parked on their circuit's timers until deadline,
+        //   anything else yields until then
+        void sleep_until(std::chrono::steady_clock::time_point deadline) {
+            Circuit* circuit = try_this_circuit();
+            if(not circuit)
+                throw kit::yield_exception();
+            circuit->sleep_until(deadline);
+        }
+        template<class Duration>
+        void sleep_for(Duration d) {
+            sleep_until(std::chrono::steady_clock::now() + d);
+        }
+        
+        // coroutines are parked on their circuit's reactor until fd is
+        //   ready for events (READ and/or WRITE), anything else yields
+        void wait_io(int fd, unsigned events) {
+            Circuit* circuit = try_this_circuit();
+            if(not circuit)
+                throw kit::yield_exception();
+            circuit->wait_io(fd, events);
         }
         
+        // throws std::out_of_range if not called from one of our circuits
         Circuit& this_circuit(){
-            return *m_ThreadToCircuit.with<Circuit*>(
-                [this](std::map<boost::thread::id, unsigned>& m
-            ){
-                return &circuit(m.at(boost::this_thread::get_id()));
-            });
+            Circuit* circuit = try_this_circuit();
+            if(not circuit)
+                throw std::out_of_range("not on a circuit thread");
+            return *circuit;
+        }
+        // same as above but returns nullptr instead
+        Circuit* try_this_circuit(){
+            Circuit* circuit = current();
+            return (circuit && circuit->m_pMultiplexer == this) ?
+                circuit : nullptr;
         }
 
         size_t size() const {
@@ -526,18 +2347,257 @@ class Multiplexer:
         
     private:
 
+        // circuit owned by the calling thread (set once the circuit's
+        //   thread starts, units that are stolen stay on their thief)
+        static Circuit*& current() {
+            static thread_local Circuit* circuit = nullptr;
+            return circuit;
+        }
+
+        // per-thread xorshift, rand() isn't thread-safe
+        static unsigned random() {
+            static thread_local unsigned state = 0;
+            if(not state) // seed from this thread's address space
+                state = unsigned(reinterpret_cast<uintptr_t>(&state) >> 4) | 1;
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+
+        // take a unit from the first busy circuit after thief
+        std::unique_ptr<Unit> steal(Circuit* thief) {
+            if(not m_bInit) // circuits still starting up
+                return std::unique_ptr<Unit>();
+            for(unsigned i=1;i<m_Concurrency;++i) {
+                auto unit = circuit(thief->index() + i).surrender();
+                if(unit)
+                    return unit;
+            }
+            return std::unique_ptr<Unit>();
+        }
+        void wake_idle(Circuit* busy) {
+            if(not m_bInit)
+                return;
+            for(unsigned i=1;i<m_Concurrency;++i) {
+                auto& c = circuit(busy->index() + i);
+                if(c.m_bIdle) {
+                    c.m_CondVar.notify_one();
+                    return;
+                }
+            }
+        }
+
         struct CacheLinePadding
         {
             volatile int8_t pad[CACHE_LINE_SIZE * 2];
         };
 
         const unsigned m_Concurrency;
+        // declared before the circuits so it outlives their coroutines
+        kit::stack_pool m_Stacks{MX_STACK_SIZE, bool(MX_STACK_GUARD), MX_STACK_POOL};
+        std::atomic<bool> m_bStealing = ATOMIC_VAR_INIT(bool(MX_STEAL));
+        std::atomic<bool> m_bTiming = ATOMIC_VAR_INIT(bool(MX_TIMING));
+        std::atomic<int64_t> m_TimeSlice = ATOMIC_VAR_INIT(int64_t(MX_TIME_SLICE) * 1000);
+        std::atomic<int64_t> m_Overrun = ATOMIC_VAR_INIT(int64_t(MX_OVERRUN) * 1000);
+        std::mutex m_OverrunMutex;
+        OverrunHandler m_OnOverrun;
+        std::atomic<bool> m_bInit = ATOMIC_VAR_INIT(false);
+        std::atomic<Placement> m_Placement = ATOMIC_VAR_INIT(MX_PLACEMENT);
+        std::atomic<Affinity> m_Affinity = ATOMIC_VAR_INIT(MX_AFFINITY);
+        std::atomic<unsigned> m_NextCircuit = ATOMIC_VAR_INIT(0);
         std::vector<std::tuple<std::unique_ptr<Circuit>, CacheLinePadding>> m_Circuits;
+        // declared after the circuits, so its jobs can still wake them
+        kit::blocking_pool m_Blocking{MX_BLOCKING_THREADS};
         //std::unique_ptr<Circuit> m_MultiCircuit;
+};
+
+/*
+ * Something coroutines can wait on without being polled
+ *
+ * Notify after changing whatever state the waiters are checking,
+ *   AWAIT_ON() takes care of registering before the re-check so that
+ *   notifications can't be missed
+ */
+class WaitList
+{
+    public:
+
+        WaitList() = default;
+        WaitList(const WaitList&) = delete;
+        WaitList& operator=(const WaitList&) = delete;
+
+        void add(std::shared_ptr<Multiplexer::Waiter> waiter) {
+            {
+                auto l = std::unique_lock<std::mutex>(m_Mutex);
+                // drop registrations that have already resumed
+                while(not m_Waiters.empty() && not m_Waiters.front()->pending())
+                    m_Waiters.pop_front();
+                m_Waiters.push_back(std::move(waiter));
+                m_Size.store(m_Waiters.size(), std::memory_order_relaxed);
+            }
+            // pairs with the fence in notify_*(), so either the caller's
+            //   re-check sees the change, or the notifier sees this waiter
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        // returns false if nobody was waiting
+        // notifying an empty list doesn't lock, so it's cheap to call
+        //   after every change
+        bool notify_one() {
+            if(not maybe_waiting())
+                return false;
+            auto l = std::unique_lock<std::mutex>(m_Mutex);
+            while(not m_Waiters.empty()) {
+                auto waiter = std::move(m_Waiters.front());
+                m_Waiters.pop_front();
+                m_Size.store(m_Waiters.size(), std::memory_order_relaxed);
+                if(Multiplexer::Waiter::notify(waiter))
+                    return true;
+            }
+            return false;
+        }
+        void notify_all() {
+            if(not maybe_waiting())
+                return;
+            std::deque<std::shared_ptr<Multiplexer::Waiter>> waiters;
+            {
+                auto l = std::unique_lock<std::mutex>(m_Mutex);
+                waiters.swap(m_Waiters);
+                m_Size.store(0, std::memory_order_relaxed);
+            }
+            for(auto&& waiter: waiters)
+                Multiplexer::Waiter::notify(waiter);
+        }
+
+        bool empty() const {
+            auto l = std::unique_lock<std::mutex>(m_Mutex);
+            return m_Waiters.empty();
+        }
+
+    private:
+
+        bool maybe_waiting() const {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return m_Size.load(std::memory_order_relaxed) != 0;
+        }
 
-        // read-write mutex might be more optimal here
-        kit::mutex_wrap<std::map<boost::thread::id, unsigned>> m_ThreadToCircuit;
+        mutable std::mutex m_Mutex;
+        std::deque<std::shared_ptr<Multiplexer::Waiter>> m_Waiters;
+        // m_Waiters.size(), for notifying without the lock when empty
+        std::atomic<size_t> m_Size = ATOMIC_VAR_INIT(0);
 };
 
+inline Multiplexer::Unit::~Unit()
+{
+    // let anything still holding our waiter know it's stale
+    if(m_pWaiter)
+        m_pWaiter->done();
+    if(m_pGroup) {
+        m_Push = push_coro_t(); // unwind before anyone wait()s past us
+        m_pGroup->leave();
+    }
+}
+
+inline void Multiplexer::Unit::join_group()
+{
+    TaskGroup::State* scoped = TaskGroup::Scope::scoped();
+    if(scoped)
+        m_pGroup = scoped->shared_from_this();
+    else {
+        Circuit* circuit = current();
+        Unit* parent = circuit ? circuit->this_unit() : nullptr;
+        if(parent)
+            m_pGroup = parent->m_pGroup;
+    }
+    if(m_pGroup)
+        ++m_pGroup->units;
+}
+
+inline Multiplexer::TaskGroup::State::State():
+    waiters(kit::make_unique<WaitList>())
+{}
+inline Multiplexer::TaskGroup::State::~State() {}
+
+inline void Multiplexer::TaskGroup::State::watch(
+    const std::shared_ptr<Waiter>& w
+){
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        if(not cancelled) {
+            // drop waiters that are gone, every time the list doubles
+            if(parked.size() >= std::max<size_t>(16, pruned * 2)) {
+                parked.erase(std::remove_if(parked.begin(), parked.end(),
+                    [](const std::weak_ptr<Waiter>& p){ return p.expired(); }
+                ), parked.end());
+                pruned = parked.size();
+            }
+            parked.push_back(w);
+            return;
+        }
+    }
+    Waiter::notify(w);
+}
+
+inline void Multiplexer::TaskGroup::State::leave()
+{
+    if(--units)
+        return;
+    {
+        std::unique_lock<std::mutex> l(mutex);
+    }
+    cond.notify_all();
+    waiters->notify_all();
+}
+
+inline void Multiplexer::TaskGroup::cancel()
+{
+    std::vector<std::weak_ptr<Waiter>> parked;
+    {
+        std::unique_lock<std::mutex> l(m_pState->mutex);
+        if(m_pState->cancelled.exchange(true))
+            return;
+        parked.swap(m_pState->parked);
+    }
+    for(auto&& p: parked)
+        if(auto w = p.lock())
+            Waiter::notify(w);
+}
+
+inline void Multiplexer::TaskGroup::wait(Multiplexer& mx)
+{
+    auto& s = *m_pState;
+    Circuit* circuit = mx.try_this_circuit();
+    Unit* unit = circuit ? circuit->this_unit() : nullptr;
+    if(unit && unit->m_pPull) {
+        auto waiting = mx.waiting(*s.waiters);
+        while(s.units)
+            waiting.next();
+        return;
+    }
+    std::unique_lock<std::mutex> l(s.mutex);
+    s.cond.wait(l, [&s]{ return s.units == 0; });
+}
+
+inline void Multiplexer::Waiting::next()
+{
+    Circuit* circuit = m_pMultiplexer->try_this_circuit();
+    if(not circuit)
+        throw kit::yield_exception();
+    if(m_bRegistered) {
+        // registered and re-checked, now actually wait
+        m_bRegistered = false;
+        circuit->park();
+        return;
+    }
+    auto waiter = circuit->prepare_wait();
+    if(not waiter) { // not a coroutine, poll
+        circuit->yield();
+        return;
+    }
+    m_pList->add(std::move(waiter));
+    m_bRegistered = true; // caller re-checks before we park
+}
+
 #endif
 
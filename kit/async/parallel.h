@@ -0,0 +1,211 @@
+#ifndef PARALLEL_H_C7HW3PLA
+#define PARALLEL_H_C7HW3PLA
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/optional.hpp>
+#include "mx.h"
+
+namespace kit
+{
+    namespace detail
+    {
+        // a range split into chunks of grain indices, which whoever is
+        //   free claims next, so fast circuits take over the chunks
+        //   that slow ones haven't gotten to
+        struct parallel_job
+        {
+            parallel_job(size_t size, size_t grain):
+                size(size),
+                grain(grain),
+                left((size + grain - 1) / grain)
+            {}
+
+            // runs chunks until there are none left to claim
+            template<class Func>
+            void work(Func& func) {
+                while(true) {
+                    const size_t first = next.fetch_add(grain);
+                    if(first >= size)
+                        return;
+                    const size_t last = std::min(first + grain, size);
+                    // after a failure, the rest are only counted down
+                    if(not failed) {
+                        try{
+                            func(first, last);
+                        }catch(...){
+                            if(not failed.exchange(true))
+                                error = std::current_exception();
+                        }
+                    }
+                    if(left.fetch_sub(1) == 1)
+                        finish();
+                }
+            }
+            bool done() const {
+                return left == 0;
+            }
+            void finish() {
+                {
+                    std::unique_lock<std::mutex> l(mutex);
+                }
+                cond.notify_all();
+                waiters.notify_all();
+            }
+            // waits for chunks claimed by other circuits, parking if
+            //   called from a coroutine, otherwise blocking the thread
+            void wait(Multiplexer& mx) {
+                if(done())
+                    return;
+                Multiplexer::Circuit* circuit = mx.try_this_circuit();
+                Multiplexer::Unit* unit = circuit ? circuit->this_unit() : nullptr;
+                if(unit && unit->m_pPull) {
+                    auto waiting = mx.waiting(waiters);
+                    while(not done())
+                        waiting.next();
+                    return;
+                }
+                std::unique_lock<std::mutex> l(mutex);
+                cond.wait(l, [this]{ return done(); });
+            }
+
+            const size_t size;
+            const size_t grain;
+            std::atomic<size_t> next = ATOMIC_VAR_INIT(0);
+            // chunks that haven't finished yet
+            std::atomic<size_t> left;
+            std::atomic<bool> failed = ATOMIC_VAR_INIT(false);
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable cond;
+            WaitList waiters;
+        };
+
+        // grain == 0 picks one that gives each circuit a few chunks
+        inline size_t parallel_grain(size_t size, size_t grain, Multiplexer& mx) {
+            if(grain)
+                return grain;
+            return std::max<size_t>(1, size / (mx.size() * 8));
+        }
+    }
+
+    /*
+     * Calls func(first, last) for consecutive chunks of [begin, end)
+     *   across every circuit of mx, and returns once all of them have
+     *   run (rethrowing the first exception, if any)
+     *
+     * The caller works on chunks too, and the helpers only run chunks
+     *   that nobody has claimed yet, so this finishes even if every
+     *   circuit is busy
+     * From a coroutine this parks while waiting for other circuits to
+     *   finish their chunks, so it doesn't hold up the calling circuit
+     */
+    template<class Func>
+    void parallel_chunks(
+        size_t begin,
+        size_t end,
+        Func func,
+        size_t grain = 0,
+        Multiplexer& mx = MX
+    ) {
+        if(end <= begin)
+            return;
+        const size_t size = end - begin;
+        auto job = std::make_shared<detail::parallel_job>(
+            size, detail::parallel_grain(size, grain, mx)
+        );
+        auto chunk = [&func, begin](size_t first, size_t last) {
+            func(begin + first, begin + last);
+        };
+        // only runs while job is unfinished, so chunk is still around
+        typedef decltype(chunk) Chunk;
+        Chunk* chunkp = &chunk;
+
+        Multiplexer::Circuit* self = mx.try_this_circuit();
+        size_t helpers = std::min<size_t>(job->left - 1, mx.size());
+        for(unsigned i=0; i<mx.size() && helpers; ++i) {
+            if(&mx[i] == self)
+                continue;
+            mx[i].post([job, chunkp]{
+                job->work(*chunkp);
+            });
+            --helpers;
+        }
+        job->work(chunk);
+        job->wait(mx);
+        if(job->error)
+            std::rethrow_exception(job->error);
+    }
+
+    // calls func(i) for every i in [begin, end), see parallel_chunks()
+    template<class Func>
+    void parallel_for(
+        size_t begin,
+        size_t end,
+        Func func,
+        size_t grain = 0,
+        Multiplexer& mx = MX
+    ) {
+        parallel_chunks(begin, end, [&func](size_t first, size_t last) {
+            for(size_t i = first; i < last; ++i)
+                func(i);
+        }, grain, mx);
+    }
+
+    // *(out + i) = func(*(first + i)) for each element, like
+    //   std::transform, returns the end of the output
+    // iterators are random access, see parallel_chunks()
+    template<class In, class Out, class Func>
+    Out parallel_transform(
+        In first,
+        In last,
+        Out out,
+        Func func,
+        size_t grain = 0,
+        Multiplexer& mx = MX
+    ) {
+        const size_t size = std::distance(first, last);
+        parallel_chunks(0, size, [&](size_t b, size_t e) {
+            std::transform(first + b, first + e, out + b, func);
+        }, grain, mx);
+        return out + size;
+    }
+
+    // folds [first, last) into init with an associative op, like
+    //   std::accumulate, each chunk is folded separately and the results
+    //   are combined in order, so op doesn't need to be commutative
+    // iterators are random access, see parallel_chunks()
+    template<class It, class T, class Op>
+    T parallel_reduce(
+        It first,
+        It last,
+        T init,
+        Op op,
+        size_t grain = 0,
+        Multiplexer& mx = MX
+    ) {
+        const size_t size = std::distance(first, last);
+        if(not size)
+            return init;
+        grain = detail::parallel_grain(size, grain, mx);
+        std::vector<boost::optional<T>> partial((size + grain - 1) / grain);
+        parallel_chunks(0, size, [&](size_t b, size_t e) {
+            T r = *(first + b);
+            for(size_t i = b + 1; i < e; ++i)
+                r = op(std::move(r), *(first + i));
+            partial[b / grain] = std::move(r);
+        }, grain, mx);
+        for(auto&& r: partial)
+            init = op(std::move(init), std::move(*r));
+        return init;
+    }
+}
+
+#endif
+
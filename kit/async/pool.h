@@ -0,0 +1,315 @@
+#ifndef POOL_H_W3LZ8KRM
+#define POOL_H_W3LZ8KRM
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <boost/coroutine/stack_context.hpp>
+#include <boost/coroutine/stack_traits.hpp>
+#include "../kit.h"
+
+#ifndef __WIN32__
+    #include <sys/mman.h>
+#endif
+
+namespace kit
+{
+    /*
+     * Recycles coroutine stacks instead of allocating one per coroutine
+     *
+     * Stacks are mmap'd with an optional guard page below them (so an
+     *   overflow faults instead of corrupting the heap), and up to
+     *   max_cached of them are kept around after their coroutines finish
+     * The guard page is part of stack_size
+     *
+     * allocator() is a boost.coroutine StackAllocator, the pool must
+     *   outlive every coroutine created with it
+     * Thread-safe, stacks may be released by a different thread
+     */
+    class stack_pool
+    {
+        public:
+
+            struct allocator
+            {
+                stack_pool* pool;
+
+                void allocate(boost::coroutines::stack_context& ctx, size_t size) {
+                    pool->acquire(ctx, size);
+                }
+                void deallocate(boost::coroutines::stack_context& ctx) {
+                    pool->release(ctx);
+                }
+            };
+
+            // stack_size of 0 picks boost's default
+            explicit stack_pool(
+                size_t stack_size = 0,
+                bool guard = true,
+                size_t max_cached = 1024
+            ):
+                m_StackSize(round(stack_size)),
+                m_bGuard(guard),
+                m_MaxCached(max_cached)
+            {}
+            stack_pool(const stack_pool&) = delete;
+            stack_pool& operator=(const stack_pool&) = delete;
+            ~stack_pool() {
+                clear();
+            }
+
+            allocator get_allocator() {
+                allocator a;
+                a.pool = this;
+                return a;
+            }
+
+            // only affects new coroutines, cached stacks are dropped
+            void stack_size(size_t sz) {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                m_StackSize = round(sz);
+                free_all();
+            }
+            size_t stack_size() const {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                return m_StackSize;
+            }
+            bool guard() const {
+                return m_bGuard;
+            }
+            void max_cached(size_t n) {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                m_MaxCached = n;
+            }
+            size_t cached() const {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                return m_Free.size();
+            }
+            void clear() {
+                std::unique_lock<std::mutex> l(m_Mutex);
+                free_all();
+            }
+
+        private:
+
+            struct Stack
+            {
+                void* base;
+                size_t size;
+            };
+
+            static size_t round(size_t sz) {
+                typedef boost::coroutines::stack_traits traits;
+                if(not sz)
+                    sz = traits::default_size();
+                sz = std::max(sz, traits::minimum_size());
+                const size_t page = traits::page_size();
+                return (sz + page - 1) / page * page;
+            }
+
+            // (like boost's protected_stack_allocator, ctx.size includes
+            //   the guard page)
+            void acquire(boost::coroutines::stack_context& ctx, size_t size) {
+                Stack s;
+                s.base = nullptr;
+                {
+                    std::unique_lock<std::mutex> l(m_Mutex);
+                    if(size <= m_StackSize && not m_Free.empty()) {
+                        s = m_Free.back();
+                        m_Free.pop_back();
+                    } else
+                        s.size = std::max(round(size), m_StackSize);
+                }
+                if(not s.base)
+                    s.base = map(s.size, m_bGuard);
+                ctx.size = s.size;
+                ctx.sp = static_cast<char*>(s.base) + s.size; // grows down
+            }
+            void release(boost::coroutines::stack_context& ctx) {
+                Stack s;
+                s.size = ctx.size;
+                s.base = static_cast<char*>(ctx.sp) - s.size;
+                {
+                    std::unique_lock<std::mutex> l(m_Mutex);
+                    if(s.size == m_StackSize && m_Free.size() < m_MaxCached) {
+                        m_Free.push_back(s);
+                        return;
+                    }
+                }
+                unmap(s);
+            }
+
+            static void* map(size_t size, bool guard) {
+#ifndef __WIN32__
+                void* p = ::mmap(0, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(p == MAP_FAILED)
+                    throw std::bad_alloc();
+                if(guard)
+                    ::mprotect(p, boost::coroutines::stack_traits::page_size(), PROT_NONE);
+                return p;
+#else
+                (void)guard;
+                void* p = std::malloc(size);
+                if(not p)
+                    throw std::bad_alloc();
+                return p;
+#endif
+            }
+            static void unmap(const Stack& s) {
+#ifndef __WIN32__
+                ::munmap(s.base, s.size);
+#else
+                std::free(s.base);
+#endif
+            }
+
+            void free_all() {
+                for(auto&& s: m_Free)
+                    unmap(s);
+                m_Free.clear();
+            }
+
+            mutable std::mutex m_Mutex;
+            std::vector<Stack> m_Free;
+            size_t m_StackSize;
+            const bool m_bGuard;
+            size_t m_MaxCached;
+    };
+
+    /*
+     * Inherit from pooled<T> to give T a per-thread free list, so that
+     *   creating and destroying lots of T's reuses the same memory
+     *
+     * Objects may be freed by a different thread than allocated them:
+     *   a thread whose list is full hands half of it to a shared list,
+     *   and a thread that ran out takes a batch back from it, so
+     *   producer/consumer threads keep recycling the same memory
+     */
+    template<class T, size_t Max = 256>
+    class pooled
+    {
+        public:
+
+            static void* operator new(size_t sz) {
+                static_assert(sizeof(T) >= sizeof(Node), "T is too small to pool");
+                if(sz == sizeof(T)) {
+                    if(not t_pFree && not t_bDead)
+                        refill();
+                    if(t_pFree) {
+                        Node* n = t_pFree;
+                        t_pFree = n->next;
+                        --t_Count;
+                        return n;
+                    }
+                }
+                return ::operator new(sz);
+            }
+            static void operator delete(void* p, size_t sz) {
+                if(sz == sizeof(T) && not t_bDead) {
+                    Sentry::attach();
+                    if(t_Count >= Max)
+                        spill(Max / 2);
+                    Node* n = static_cast<Node*>(p);
+                    n->next = t_pFree;
+                    t_pFree = n;
+                    ++t_Count;
+                    return;
+                }
+                ::operator delete(p);
+            }
+
+        private:
+
+            struct Node
+            {
+                Node* next;
+            };
+
+            // free memory shared between threads
+            struct Shared
+            {
+                std::mutex mutex;
+                Node* head = nullptr;
+                size_t count = 0;
+            };
+            static Shared& shared() {
+                // never destroyed, threads may still be exiting
+                static Shared* s = new Shared;
+                return *s;
+            }
+
+            // move n nodes from our list to the shared one
+            static void spill(size_t n) {
+                if(not t_pFree || not n)
+                    return;
+                Node* first = t_pFree;
+                Node* last = first;
+                size_t count = 1;
+                while(count < n && last->next) {
+                    last = last->next;
+                    ++count;
+                }
+                t_pFree = last->next;
+                t_Count -= count;
+                auto& s = shared();
+                std::unique_lock<std::mutex> l(s.mutex);
+                last->next = s.head;
+                s.head = first;
+                s.count += count;
+            }
+            // take up to half our capacity from the shared list
+            static void refill() {
+                Sentry::attach();
+                auto& s = shared();
+                std::unique_lock<std::mutex> l(s.mutex);
+                if(not s.head)
+                    return;
+                Node* first = s.head;
+                Node* last = first;
+                size_t count = 1;
+                while(count < Max / 2 && last->next) {
+                    last = last->next;
+                    ++count;
+                }
+                s.head = last->next;
+                s.count -= count;
+                l.unlock();
+                last->next = t_pFree;
+                t_pFree = first;
+                t_Count += count;
+            }
+
+            // gives the memory to other threads when this one exits,
+            //   attach() before anything goes on this thread's list
+            struct Sentry
+            {
+                ~Sentry() {
+                    spill(t_Count);
+                    t_bDead = true; // don't cache anything freed after this
+                }
+                static void attach() {
+                    static thread_local Sentry sentry;
+                    (void)sentry;
+                }
+            };
+
+            // plain values so they're still valid during thread exit
+            static thread_local Node* t_pFree;
+            static thread_local size_t t_Count;
+            static thread_local bool t_bDead;
+    };
+
+    template<class T, size_t Max>
+    thread_local typename pooled<T, Max>::Node* pooled<T, Max>::t_pFree = nullptr;
+    template<class T, size_t Max>
+    thread_local size_t pooled<T, Max>::t_Count = 0;
+    template<class T, size_t Max>
+    thread_local bool pooled<T, Max>::t_bDead = false;
+}
+
+#endif
+
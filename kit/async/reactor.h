@@ -0,0 +1,250 @@
+#ifndef REACTOR_H_T5WJ0GQD
+#define REACTOR_H_T5WJ0GQD
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include <string>
+#include "../kit.h"
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <unistd.h>
+    #define KIT_REACTOR 1
+#else
+    #define KIT_REACTOR 0
+#endif
+
+namespace kit
+{
+    /*
+     * Readiness notifications for file descriptors (epoll)
+     *
+     * Waiters are registered per fd and event, and handed back by poll()
+     *   exactly once, when that fd becomes ready
+     *
+     * fds are registered once (one-shot) and only re-armed while
+     *   someone is waiting on them, so nothing has to be unregistered
+     *   before an fd is closed (as long as nobody is still waiting on it)
+     * Waiters that give up before their fd is ready are only dropped by
+     *   prune(), so owners should call it every so often
+     *
+     * Everything but interrupt() must be called from the owning thread
+     * Without epoll, add() always fails and callers should poll instead
+     */
+    template<class T>
+    class reactor
+    {
+        public:
+
+            enum Event {
+                READ = kit::bit(0),
+                WRITE = kit::bit(1)
+            };
+
+            reactor() = default;
+            reactor(const reactor&) = delete;
+            reactor& operator=(const reactor&) = delete;
+            ~reactor() {
+#if KIT_REACTOR
+                if(m_Epoll != -1)
+                    ::close(m_Epoll);
+                if(m_Event != -1)
+                    ::close(m_Event);
+#endif
+            }
+
+            // wait for fd to become ready for events (READ and/or WRITE)
+            // returns false if waiting on fds isn't supported
+            bool add(int fd, unsigned events, T value) {
+#if KIT_REACTOR
+                open();
+                auto& w = m_Waiters[fd];
+                if(events & READ) {
+                    w.read.push_back(value);
+                    ++m_Size;
+                }
+                if(events & WRITE) {
+                    w.write.push_back(std::move(value));
+                    ++m_Size;
+                }
+                arm(fd, w);
+                return true;
+#else
+                return false;
+#endif
+            }
+
+            // calls func(T&) for each waiter whose fd is ready, blocking
+            //   for up to timeout_ms (-1 is forever) or until interrupt()
+            template<class Func>
+            void poll(int timeout_ms, Func&& func) {
+#if KIT_REACTOR
+                if(m_Epoll == -1)
+                    return;
+                epoll_event events[64];
+                int n = ::epoll_wait(m_Epoll, events, 64, timeout_ms);
+                for(int i=0;i<n;++i) {
+                    const int fd = events[i].data.fd;
+                    if(fd == m_Event) {
+                        uint64_t count;
+                        while(::read(m_Event, &count, sizeof(count)) > 0) {}
+                        continue;
+                    }
+                    auto itr = m_Waiters.find(fd);
+                    if(itr == m_Waiters.end())
+                        continue;
+                    auto& w = itr->second;
+                    w.armed = 0; // one-shot
+                    const unsigned ev = events[i].events;
+                    // errors and hangups wake everyone, so they can see it
+                    const bool err = ev & (EPOLLERR | EPOLLHUP);
+                    if(err || (ev & EPOLLIN))
+                        fire(w.read, func);
+                    if(err || (ev & EPOLLOUT))
+                        fire(w.write, func);
+                    arm(fd, w);
+                    // one-shot, so it's disarmed and can be forgotten
+                    if(w.read.empty() && w.write.empty())
+                        m_Waiters.erase(itr);
+                }
+#endif
+            }
+
+            // drops waiters stale(T&) returns true for, fds left without
+            //   any stop being watched, even if they were closed already
+            template<class Stale>
+            void prune(Stale&& stale) {
+#if KIT_REACTOR
+                for(auto itr = m_Waiters.begin(); itr != m_Waiters.end();) {
+                    auto& w = itr->second;
+                    drop(w.read, stale);
+                    drop(w.write, stale);
+                    if(w.read.empty() && w.write.empty()) {
+                        // fails harmlessly if the fd was closed
+                        if(w.added)
+                            ::epoll_ctl(m_Epoll, EPOLL_CTL_DEL, itr->first, nullptr);
+                        itr = m_Waiters.erase(itr);
+                        continue;
+                    }
+                    arm(itr->first, w);
+                    ++itr;
+                }
+#else
+                (void)stale;
+#endif
+            }
+
+            // wake up poll() from any thread
+            void interrupt() {
+#if KIT_REACTOR
+                if(m_bOpen) {
+                    uint64_t one = 1;
+                    ssize_t r = ::write(m_Event, &one, sizeof(one));
+                    (void)r;
+                }
+#endif
+            }
+
+            // nobody waiting on any fd
+            bool empty() const {
+                return m_Size == 0;
+            }
+            size_t size() const {
+                return m_Size;
+            }
+
+        private:
+
+            struct Waiters
+            {
+                std::vector<T> read;
+                std::vector<T> write;
+                unsigned armed = 0;
+                bool added = false;
+            };
+
+#if KIT_REACTOR
+            void open() {
+                if(m_bOpen)
+                    return;
+                m_Epoll = ::epoll_create1(EPOLL_CLOEXEC);
+                if(m_Epoll == -1)
+                    throw std::runtime_error(
+                        std::string("reactor epoll_create1 failed (")+
+                        std::to_string(errno)+")"
+                    );
+                m_Event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if(m_Event == -1)
+                    throw std::runtime_error(
+                        std::string("reactor eventfd failed (")+
+                        std::to_string(errno)+")"
+                    );
+                epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.fd = m_Event;
+                ::epoll_ctl(m_Epoll, EPOLL_CTL_ADD, m_Event, &ev);
+                m_bOpen = true;
+            }
+
+            // (re-)enable one-shot notification for everything waited on
+            void arm(int fd, Waiters& w) {
+                unsigned want = 0;
+                if(not w.read.empty())
+                    want |= EPOLLIN;
+                if(not w.write.empty())
+                    want |= EPOLLOUT;
+                if(want == w.armed)
+                    return;
+                epoll_event ev = {};
+                ev.events = want | EPOLLONESHOT;
+                ev.data.fd = fd;
+                // fds closed since we last saw them drop out of epoll
+                //   on their own, so fall back to whichever op works
+                int op = w.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+                if(::epoll_ctl(m_Epoll, op, fd, &ev) == -1) {
+                    op = (op == EPOLL_CTL_MOD) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+                    if(::epoll_ctl(m_Epoll, op, fd, &ev) == -1)
+                        throw std::runtime_error(
+                            std::string("reactor epoll_ctl failed (")+
+                            std::to_string(errno)+")"
+                        );
+                }
+                w.added = true;
+                w.armed = want;
+            }
+
+            template<class Stale>
+            void drop(std::vector<T>& waiters, Stale& stale) {
+                const size_t n = waiters.size();
+                waiters.erase(std::remove_if(waiters.begin(), waiters.end(),
+                    [&stale](T& w){ return stale(w); }
+                ), waiters.end());
+                m_Size -= n - waiters.size();
+            }
+
+            template<class Func>
+            void fire(std::vector<T>& waiters, Func& func) {
+                m_Size -= waiters.size();
+                std::vector<T> ready;
+                ready.swap(waiters);
+                for(auto&& w: ready)
+                    func(w);
+            }
+#endif
+
+            std::unordered_map<int, Waiters> m_Waiters;
+            size_t m_Size = 0;
+            int m_Epoll = -1;
+            int m_Event = -1;
+            std::atomic<bool> m_bOpen = ATOMIC_VAR_INIT(false);
+    };
+}
+
+#endif
+
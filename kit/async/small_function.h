@@ -0,0 +1,178 @@
+#ifndef SMALL_FUNCTION_H_J4XK9WQE
+#define SMALL_FUNCTION_H_J4XK9WQE
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace kit
+{
+    template<class Sig, size_t Size = 48>
+    class small_function;
+
+    /*
+     * Move-only std::function that keeps callables of up to Size bytes
+     *   inline instead of allocating them, bigger ones go on the heap
+     *
+     * Also holds move-only callables (like Task), which std::function
+     *   can't
+     */
+    template<class R, class ...Args, size_t Size>
+    class small_function<R(Args...), Size>
+    {
+        public:
+
+            small_function() = default;
+            small_function(std::nullptr_t) {}
+
+            template<class Func, class = typename std::enable_if<
+                not std::is_same<typename std::decay<Func>::type, small_function>::value
+            >::type>
+            small_function(Func&& func) {
+                assign(std::forward<Func>(func));
+            }
+
+            small_function(small_function&& rhs) noexcept {
+                take(rhs);
+            }
+            small_function& operator=(small_function&& rhs) noexcept {
+                if(this != &rhs) {
+                    reset();
+                    take(rhs);
+                }
+                return *this;
+            }
+            small_function(const small_function&) = delete;
+            small_function& operator=(const small_function&) = delete;
+
+            ~small_function() {
+                reset();
+            }
+
+            R operator()(Args... args) {
+                return m_pOps->call(data(), std::forward<Args>(args)...);
+            }
+
+            explicit operator bool() const {
+                return m_pOps != nullptr;
+            }
+            // false if the callable had to be allocated
+            bool local() const {
+                return not m_pOps || m_pOps->local;
+            }
+
+            void reset() {
+                if(m_pOps) {
+                    m_pOps->destroy(data());
+                    m_pOps = nullptr;
+                }
+            }
+
+        private:
+
+            struct Ops
+            {
+                R (*call)(void*, Args&&...);
+                // move-constructs into dest and destroys src
+                void (*move)(void* src, void* dest);
+                void (*destroy)(void*);
+                bool local;
+            };
+
+            template<class Func>
+            struct Local
+            {
+                static Func* get(void* p) {
+                    return static_cast<Func*>(p);
+                }
+                static R call(void* p, Args&&... args) {
+                    return static_cast<R>((*get(p))(std::forward<Args>(args)...));
+                }
+                static void move(void* src, void* dest) {
+                    new(dest) Func(std::move(*get(src)));
+                    get(src)->~Func();
+                }
+                static void destroy(void* p) {
+                    get(p)->~Func();
+                }
+                static const Ops* ops() {
+                    static const Ops o = {&call, &move, &destroy, true};
+                    return &o;
+                }
+            };
+            // buffer holds a pointer to the callable
+            template<class Func>
+            struct Remote
+            {
+                static Func*& get(void* p) {
+                    return *static_cast<Func**>(p);
+                }
+                static R call(void* p, Args&&... args) {
+                    return static_cast<R>((*get(p))(std::forward<Args>(args)...));
+                }
+                static void move(void* src, void* dest) {
+                    new(dest) Func*(get(src));
+                }
+                static void destroy(void* p) {
+                    delete get(p);
+                }
+                static const Ops* ops() {
+                    static const Ops o = {&call, &move, &destroy, false};
+                    return &o;
+                }
+            };
+
+            template<class Func>
+            static bool empty(const Func&) {
+                return false;
+            }
+            template<class Sig>
+            static bool empty(const std::function<Sig>& func) {
+                return not func;
+            }
+            template<class T>
+            static bool empty(T* func) {
+                return not func;
+            }
+
+            template<class Func>
+            void assign(Func&& func) {
+                typedef typename std::decay<Func>::type F;
+                if(empty(func))
+                    return;
+                if(sizeof(F) <= Size &&
+                    alignof(F) <= alignof(Buffer) &&
+                    std::is_nothrow_move_constructible<F>::value
+                ){
+                    new(data()) F(std::forward<Func>(func));
+                    m_pOps = Local<F>::ops();
+                } else {
+                    new(data()) F*(new F(std::forward<Func>(func)));
+                    m_pOps = Remote<F>::ops();
+                }
+            }
+            void take(small_function& rhs) {
+                if(rhs.m_pOps) {
+                    rhs.m_pOps->move(rhs.data(), data());
+                    m_pOps = rhs.m_pOps;
+                    rhs.m_pOps = nullptr;
+                }
+            }
+
+            void* data() {
+                return &m_Buffer;
+            }
+
+            typedef typename std::aligned_storage<
+                (Size < sizeof(void*) ? sizeof(void*) : Size),
+                alignof(std::max_align_t)
+            >::type Buffer;
+            Buffer m_Buffer;
+            const Ops* m_pOps = nullptr;
+    };
+}
+
+#endif
+
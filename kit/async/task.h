@@ -5,7 +5,14 @@
 #include <boost/coroutine/all.hpp>
 #include <future>
 #include <stdexcept>
+#include <boost/optional.hpp>
 #include "../kit.h"
+#include "small_function.h"
+
+// bytes of captures a Task keeps inline before allocating them
+#ifndef TASK_BUFFER
+#define TASK_BUFFER 48
+#endif
 
 template<class R, class ...Args>
 class Task;
@@ -17,8 +24,16 @@ class Task<R (Args...)>
 
         template<class ...T>
         explicit Task(T&&... t):
-            m_Func(std::forward<T>(t)...)
+            m_Func(std::forward<T>(t)...),
+            m_Promise(std::promise<R>())
         {}
+        
+        // a Task that nobody will get_future() from, which skips
+        //   allocating the promise (its result and errors are dropped)
+        template<class Func>
+        static Task detached(Func&& func) {
+            return Task(Detached(), std::forward<Func>(func));
+        }
 
         Task(Task&&) = default;
         Task& operator=(Task&&) = default;
@@ -29,25 +44,62 @@ class Task<R (Args...)>
         template<class ...T>
         void operator()(T&&... t) {
             try{
-                m_Promise.set_value(m_Func(std::forward<T>(t)...));
+                set(m_Func(std::forward<T>(t)...));
             }catch(const kit::yield_exception& e){
                 throw e;
+            }catch(const boost::coroutines::detail::forced_unwind&){
+                throw; // coroutine destroyed, let its stack unwind
             }catch(...){
-                m_Promise.set_exception(std::current_exception());
+                fail();
             }
             //}catch(...){
             //    assert(false);
             //}
         }
+        
+        // non-throwing version of operator()
+        // returns false instead of rethrowing kit::yield_exception,
+        //   meaning the function asked to be called again later
+        template<class ...T>
+        bool poll(T&&... t) {
+            try{
+                set(m_Func(std::forward<T>(t)...));
+            }catch(const kit::yield_exception&){
+                return false;
+            }catch(const boost::coroutines::detail::forced_unwind&){
+                throw; // coroutine destroyed, let its stack unwind
+            }catch(...){
+                fail();
+            }
+            return true;
+        }
 
         std::future<R> get_future() {
-            return m_Promise.get_future();
+            if(not m_Promise)
+                throw std::future_error(std::future_errc::no_state);
+            return m_Promise->get_future();
         }
 
     private:
+        
+        struct Detached {};
+        template<class Func>
+        Task(Detached, Func&& func):
+            m_Func(std::forward<Func>(func))
+        {}
+        
+        template<class V>
+        void set(V&& v) {
+            if(m_Promise)
+                m_Promise->set_value(std::forward<V>(v));
+        }
+        void fail() {
+            if(m_Promise)
+                m_Promise->set_exception(std::current_exception());
+        }
 
-        std::function<R(Args...)> m_Func;
-        std::promise<R> m_Promise;
+        kit::small_function<R(Args...), TASK_BUFFER> m_Func;
+        boost::optional<std::promise<R>> m_Promise;
 };
 
 template<class ...Args>
@@ -57,8 +109,15 @@ class Task<void(Args...)>
 
         template<class ...T>
         explicit Task(T&&... t):
-            m_Func(std::forward<T>(t)...)
+            m_Func(std::forward<T>(t)...),
+            m_Promise(std::promise<void>())
         {}
+        
+        // see Task<R(Args...)>::detached()
+        template<class Func>
+        static Task detached(Func&& func) {
+            return Task(Detached(), std::forward<Func>(func));
+        }
 
         Task(Task&&) = default;
         Task& operator=(Task&&) = default;
@@ -70,24 +129,57 @@ class Task<void(Args...)>
         void operator()(T&&... t) {
             try{
                 m_Func(std::forward<T>(t)...);
-                m_Promise.set_value();
-            //}catch(const boost::coroutines::detail::forced_unwind& e){
-            //    throw e;
+                set();
+            }catch(const boost::coroutines::detail::forced_unwind&){
+                throw; // coroutine destroyed, let its stack unwind
             }catch(const kit::yield_exception& e){
                 throw e;
             }catch(...){
-                m_Promise.set_exception(std::current_exception());
+                fail();
+            }
+        }
+        
+        // non-throwing version of operator(), see above
+        template<class ...T>
+        bool poll(T&&... t) {
+            try{
+                m_Func(std::forward<T>(t)...);
+                set();
+            }catch(const kit::yield_exception&){
+                return false;
+            }catch(const boost::coroutines::detail::forced_unwind&){
+                throw; // coroutine destroyed, let its stack unwind
+            }catch(...){
+                fail();
             }
+            return true;
         }
 
         std::future<void> get_future() {
-            return m_Promise.get_future();
+            if(not m_Promise)
+                throw std::future_error(std::future_errc::no_state);
+            return m_Promise->get_future();
         }
 
     private:
+        
+        struct Detached {};
+        template<class Func>
+        Task(Detached, Func&& func):
+            m_Func(std::forward<Func>(func))
+        {}
+        
+        void set() {
+            if(m_Promise)
+                m_Promise->set_value();
+        }
+        void fail() {
+            if(m_Promise)
+                m_Promise->set_exception(std::current_exception());
+        }
 
-        std::function<void(Args...)> m_Func;
-        std::promise<void> m_Promise;
+        kit::small_function<void(Args...), TASK_BUFFER> m_Func;
+        boost::optional<std::promise<void>> m_Promise;
 
 };
 
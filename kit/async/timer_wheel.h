@@ -0,0 +1,166 @@
+#ifndef TIMER_WHEEL_H_Q8VN3XRC
+#define TIMER_WHEEL_H_Q8VN3XRC
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace kit
+{
+    /*
+     * Hierarchical timer wheel (Varghese & Lauck)
+     *
+     * Each level has SLOTS buckets, each bucket covering SLOTS times as
+     *   many ticks as a bucket on the level below it.  Adding a timer
+     *   and expiring it are O(1), timers are only moved down a level
+     *   when the lower level wraps around, so a large number of far
+     *   deadlines costs nothing until they get close
+     *
+     * Deadlines past the range of the top level are parked in its
+     *   farthest bucket and re-filed each time it comes around
+     *
+     * Not thread-safe, meant to be owned by a single thread
+     */
+    template<class T>
+    class timer_wheel
+    {
+        public:
+
+            typedef std::chrono::steady_clock clock;
+
+            explicit timer_wheel(
+                clock::duration resolution = std::chrono::milliseconds(1),
+                clock::time_point now = clock::now()
+            ):
+                m_Resolution(resolution),
+                m_Epoch(now)
+            {}
+
+            timer_wheel(const timer_wheel&) = delete;
+            timer_wheel& operator=(const timer_wheel&) = delete;
+
+            // timers never expire early, but may expire up to one tick late
+            void add(clock::time_point deadline, T value) {
+                uint64_t tick = m_Tick;
+                if(deadline > m_Epoch) {
+                    // round up
+                    tick = std::max(tick, uint64_t(
+                        (deadline - m_Epoch + m_Resolution - clock::duration(1)) /
+                            m_Resolution
+                    ));
+                }
+                file(Entry{tick, std::move(value)});
+                ++m_Size;
+            }
+
+            // calls func(T&) for each timer whose deadline has passed by now
+            template<class Func>
+            void advance(clock::time_point now, Func&& func) {
+                if(now < m_Epoch)
+                    return;
+                const uint64_t target = uint64_t((now - m_Epoch) / m_Resolution);
+                while(m_Tick <= target) {
+                    if(not m_Size) {
+                        m_Tick = target + 1; // nothing to do, skip ahead
+                        return;
+                    }
+                    const unsigned idx = m_Tick & MASK;
+                    if(idx == 0)
+                        cascade();
+                    auto& slot = m_Slots[0][idx];
+                    if(not slot.empty()) {
+                        std::vector<Entry> expired;
+                        expired.swap(slot);
+                        m_Size -= expired.size();
+                        for(auto&& e: expired)
+                            func(e.value);
+                    }
+                    ++m_Tick;
+                }
+            }
+
+            // earliest time the next timer could expire, max() if empty
+            // (may be early for far timers, advance() is a no-op then)
+            clock::time_point next_expiry() const {
+                if(not m_Size)
+                    return clock::time_point::max();
+                for(uint64_t tick = m_Tick; ; ++tick) {
+                    if((tick & MASK) == 0)
+                        return time_of(tick); // needs a cascade first
+                    if(not m_Slots[0][tick & MASK].empty())
+                        return time_of(tick);
+                }
+            }
+
+            bool empty() const {
+                return m_Size == 0;
+            }
+            size_t size() const {
+                return m_Size;
+            }
+            void clear() {
+                for(auto&& level: m_Slots)
+                    for(auto&& slot: level)
+                        slot.clear();
+                m_Size = 0;
+            }
+
+        private:
+
+            static const unsigned BITS = 6;
+            static const unsigned SLOTS = 1U << BITS;
+            static const unsigned MASK = SLOTS - 1;
+            static const unsigned LEVELS = 5;
+
+            struct Entry
+            {
+                uint64_t tick;
+                T value;
+            };
+
+            void file(Entry&& e) {
+                unsigned level = 0;
+                while(level < LEVELS - 1 &&
+                    (e.tick >> (BITS * (level + 1))) !=
+                        (m_Tick >> (BITS * (level + 1)))
+                ){
+                    ++level;
+                }
+                const unsigned shift = BITS * level;
+                uint64_t pos = e.tick >> shift;
+                if(pos - (m_Tick >> shift) >= SLOTS) // out of range
+                    pos = (m_Tick >> shift) + SLOTS - 1;
+                m_Slots[level][pos & MASK].push_back(std::move(e));
+            }
+
+            // lower level wrapped around, move the timers that now fit
+            //   below their level down
+            void cascade() {
+                for(unsigned level = 1; level < LEVELS; ++level) {
+                    const unsigned idx = (m_Tick >> (BITS * level)) & MASK;
+                    std::vector<Entry> entries;
+                    entries.swap(m_Slots[level][idx]);
+                    for(auto&& e: entries)
+                        file(std::move(e));
+                    if(idx != 0)
+                        break;
+                }
+            }
+
+            clock::time_point time_of(uint64_t tick) const {
+                return m_Epoch + m_Resolution * tick;
+            }
+
+            std::vector<Entry> m_Slots[LEVELS][SLOTS];
+            // next tick to be processed
+            uint64_t m_Tick = 0;
+            size_t m_Size = 0;
+            const clock::duration m_Resolution;
+            const clock::time_point m_Epoch;
+    };
+}
+
+#endif
+
@@ -16,6 +16,7 @@
     #include <netdb.h>
     #include <sys/ioctl.h>
     #include <sys/time.h>
+    #include <poll.h>
     #define closesocket close
     #define ioctlsocket ioctl
     typedef int SOCKET;
@@ -25,6 +26,7 @@
 #endif
 
 #include <boost/lexical_cast.hpp>
+#include <boost/optional.hpp>
 #include "../async/async.h"
 
 class socket_exception:
@@ -140,9 +142,11 @@ class TCPSocket:
         {}
         TCPSocket(TCPSocket&& rhs):
             m_Socket(rhs.m_Socket),
-            m_bOpen(rhs.m_bOpen)
+            m_bOpen(rhs.m_bOpen),
+            m_pSendTurn(std::move(rhs.m_pSendTurn))
         {
             rhs.m_bOpen = false;
+            rhs.m_pSendTurn = kit::make_unique<WaitList>();
         }
         TCPSocket(const TCPSocket& rhs) = delete;
         TCPSocket& operator=(TCPSocket&& rhs) {
@@ -150,6 +154,7 @@ class TCPSocket:
                 close();
             m_Socket = std::move(rhs.m_Socket);
             m_bOpen = rhs.m_bOpen;
+            std::swap(m_pSendTurn, rhs.m_pSendTurn);
             rhs.m_bOpen = false;
             return *this;
         }
@@ -190,6 +195,14 @@ class TCPSocket:
         }
         virtual SOCKET socket() override { return m_Socket; }
         TCPSocket accept() {
+            auto r = try_accept();
+            if(not r)
+                throw kit::yield_exception();
+            return std::move(*r);
+        }
+        // Non-throwing version of accept()
+        // returns boost::none if no connection is waiting
+        boost::optional<TCPSocket> try_accept() {
             SOCKET socket;
             sockaddr_storage addr;
             socklen_t addr_sz = sizeof(addr);
@@ -197,13 +210,13 @@ class TCPSocket:
             if(socket == INVALID_SOCKET)
             {
                 if(errno == EWOULDBLOCK || errno == EAGAIN)
-                    throw kit::yield_exception();
+                    return boost::none;
                 throw socket_exception(
                     std::string("TCPSocket::accept failed (")+
                     std::to_string(errno)+")"
                 );
             }
-            return TCPSocket(socket);
+            return boost::optional<TCPSocket>(TCPSocket(socket));
         }
         void bind(uint16_t port = 0) {
             sockaddr_in sAddr;
@@ -246,39 +259,80 @@ class TCPSocket:
         
         // Async usage (inside coroutine or repeated circuit unit):
         //      YIELD_UNTIL(socket.select());
+        // Inside coroutines, prefer waiting on the circuit's reactor:
+        //      AWAIT_READ(socket.socket(), socket.recv());
         virtual bool select() const override
         {
-            fd_set fds_read;
-            int fdscount = 0;
-
-            timeval tv = {0,0};
-            //tv.tv_sec = 0;
-            //tv.tv_usec = 0;
-
-            FD_ZERO(&fds_read);
-            FD_SET(m_Socket, &fds_read);
-
             #ifndef __WIN32__
-                fdscount = m_Socket + 1;
+                // unlike select(), poll() isn't limited to fds < FD_SETSIZE
+                pollfd pfd;
+                pfd.fd = m_Socket;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                if(::poll(&pfd, 1, 0) == SOCKET_ERROR)
+                    return false; // TODO: throw socket select error
+                return pfd.revents & POLLIN;
+            #else
+                fd_set fds_read;
+                timeval tv = {0,0};
+
+                FD_ZERO(&fds_read);
+                FD_SET(m_Socket, &fds_read);
+
+                switch(::select(0, &fds_read, (fd_set*)0, (fd_set*)0, &tv))
+                {
+                    case 0:
+                        return false;
+                        break;
+                    case SOCKET_ERROR:
+                        // TODO: throw socket select error
+                        return false;
+                    default:
+                        //return true;
+                        break;
+                }
+
+                return (bool)FD_ISSET(m_Socket, &fds_read);
             #endif
+        }
 
-            switch(::select(fdscount, &fds_read, (fd_set*)0, (fd_set*)0, &tv))
+        // Throws kit::yield_exception if the socket can't take all of buf
+        // NOTE: part of buf may have been written by then, so retrying
+        //   it (as AWAIT() does) can send those bytes twice, use
+        //   send_all() (or try_send()) wherever writes can be partial
+        virtual void send(const uint8_t* buf, int sz) override {
+            int sent = 0;
+            while(sent < sz)
             {
-                case 0:
-                    return false;
-                    break;
-                case SOCKET_ERROR:
-                    // TODO: throw socket select error
-                    return false;
-                default:
-                    //return true;
-                    break;
+                int n = try_send(buf + sent, sz - sent);
+                if(n == 0)
+                    throw kit::yield_exception();
+                sent += n;
             }
-
-            return (bool)FD_ISSET(m_Socket, &fds_read);
         }
-
-        virtual void send(const uint8_t* buf, int sz) override {
+        
+        // Sends all of buf, parking the coroutine on its circuit's
+        //   reactor while the socket is full (other threads block)
+        // The progress is kept here, not on the socket, and send_all()s
+        //   on the same socket take turns, so concurrent senders never
+        //   repeat or interleave each other's bytes
+        void send_all(const uint8_t* buf, int sz, Multiplexer& mx = MX) {
+            SendTurn turn(*this, mx);
+            int sent = 0;
+            while(true)
+            {
+                sent += try_send(buf + sent, sz - sent);
+                if(sent >= sz)
+                    return;
+                wait_writable(mx);
+            }
+        }
+        void send_all(const std::string& buf, Multiplexer& mx = MX) {
+            send_all((const uint8_t*)buf.c_str(), (int)buf.size(), mx);
+        }
+        // Non-throwing version of send()
+        // returns the number of bytes sent, 0 if it would block
+        int try_send(const uint8_t* buf, int sz) {
             if(not m_bOpen)
                 throw socket_exception("TCPSocket::send socket not open");
             int sent = 0;
@@ -289,7 +343,7 @@ class TCPSocket:
                 n = ::send(m_Socket, (char*)(buf + sent), left, 0);
                 if(n==SOCKET_ERROR){
                     if(errno == EWOULDBLOCK || errno == EAGAIN)
-                        throw kit::yield_exception();
+                        break;
                     else
                         throw socket_exception(
                             std::string("TCPSocket::send socket error (")+
@@ -299,11 +353,20 @@ class TCPSocket:
                 sent += n;
                 left -= n;
             }
+            return sent;
         }
         virtual void send(std::string buf) override {
             send((const uint8_t*)buf.c_str(), (int)buf.size());
         }
         virtual int recv(uint8_t* buf, int sz) override {
+            int n = try_recv(buf, sz);
+            if(n == 0)
+                throw kit::yield_exception();
+            return n;
+        }
+        // Non-throwing version of recv()
+        // returns 0 if nothing is available yet, disconnects still throw
+        int try_recv(uint8_t* buf, int sz) {
             if(sz <= 0)
                 throw socket_exception("TCPSocket::recv buffer has no space");
             if(not m_bOpen)
@@ -312,7 +375,7 @@ class TCPSocket:
             n = ::recv(m_Socket, (char*)buf, sz, 0);
             if(n == SOCKET_ERROR){
                 if(errno == EWOULDBLOCK || errno == EAGAIN)
-                    throw kit::yield_exception();
+                    return 0;
                 else
                     throw socket_exception(
                         std::string("TCPSocket::recv socket error (")+
@@ -333,11 +396,69 @@ class TCPSocket:
             buf[r] = '\0';
             return std::string((char*)buf, r);
         }
+        boost::optional<std::string> try_recv() {
+            uint8_t buf[1024];
+            int r = try_recv(buf, sizeof(buf) - 1);
+            if(r == 0)
+                return boost::none;
+            return std::string((char*)buf, r);
+        }
         
     protected:
         
         SOCKET m_Socket;
         bool m_bOpen = false;
+        
+    private:
+        
+        static bool in_coroutine(Multiplexer& mx) {
+            Multiplexer::Circuit* circuit = mx.try_this_circuit();
+            Multiplexer::Unit* unit = circuit ? circuit->this_unit() : nullptr;
+            return unit && unit->m_pPull;
+        }
+        void wait_writable(Multiplexer& mx) {
+            if(in_coroutine(mx)) {
+                mx.wait_io(m_Socket, Multiplexer::WRITE);
+                return;
+            }
+            #ifndef __WIN32__
+                pollfd pfd;
+                pfd.fd = m_Socket;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                ::poll(&pfd, 1, -1);
+            #else
+                fd_set fds_write;
+                FD_ZERO(&fds_write);
+                FD_SET(m_Socket, &fds_write);
+                ::select(0, (fd_set*)0, &fds_write, (fd_set*)0, nullptr);
+            #endif
+        }
+        
+        // held by one send_all() at a time
+        struct SendTurn
+        {
+            SendTurn(TCPSocket& s, Multiplexer& mx):
+                socket(s)
+            {
+                if(in_coroutine(mx)) {
+                    auto waiting = mx.waiting(*socket.m_pSendTurn);
+                    while(socket.m_bSending.exchange(true))
+                        waiting.next();
+                } else {
+                    while(socket.m_bSending.exchange(true))
+                        boost::this_thread::yield();
+                }
+            }
+            ~SendTurn() {
+                socket.m_bSending = false;
+                socket.m_pSendTurn->notify_one();
+            }
+            TCPSocket& socket;
+        };
+        
+        std::atomic<bool> m_bSending = ATOMIC_VAR_INIT(false);
+        std::unique_ptr<WaitList> m_pSendTurn = kit::make_unique<WaitList>();
 };
 
 class UDPSocket:
@@ -422,36 +543,48 @@ class UDPSocket:
         virtual SOCKET socket() override { return m_Socket; }
         virtual bool select() const override
         {
-            fd_set fds_read;
-            int fdscount = 0;
-
-            timeval tv = {0,0};
-            //tv.tv_sec = 0;
-            //tv.tv_usec = 0;
-
-            FD_ZERO(&fds_read);
-            FD_SET(m_Socket, &fds_read);
-
             #ifndef __WIN32__
-                fdscount = m_Socket + 1;
-            #endif
-
-            switch(::select(fdscount, &fds_read, (fd_set*)0, (fd_set*)0, &tv))
-            {
-                case 0:
-                    return false;
-                    break;
-                case SOCKET_ERROR:
-                    // TODO: throw socket select error
-                    return false;
-                default:
-                    //return true;
-                    break;
-            }
+                // unlike select(), poll() isn't limited to fds < FD_SETSIZE
+                pollfd pfd;
+                pfd.fd = m_Socket;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                if(::poll(&pfd, 1, 0) == SOCKET_ERROR)
+                    return false; // TODO: throw socket select error
+                return pfd.revents & POLLIN;
+            #else
+                fd_set fds_read;
+                timeval tv = {0,0};
+
+                FD_ZERO(&fds_read);
+                FD_SET(m_Socket, &fds_read);
+
+                switch(::select(0, &fds_read, (fd_set*)0, (fd_set*)0, &tv))
+                {
+                    case 0:
+                        return false;
+                        break;
+                    case SOCKET_ERROR:
+                        // TODO: throw socket select error
+                        return false;
+                    default:
+                        //return true;
+                        break;
+                }
 
-            return (bool)FD_ISSET(m_Socket, &fds_read);
+                return (bool)FD_ISSET(m_Socket, &fds_read);
+            #endif
         }
+        // datagrams go out whole or not at all, so retrying after
+        //   kit::yield_exception never repeats part of one
         void send_to(const Address& addr, const uint8_t* buf, int sz)
+        {
+            if(try_send_to(addr, buf, sz) == 0)
+                throw kit::yield_exception();
+        }
+        // Non-throwing version of send_to()
+        // returns the number of bytes sent, 0 if it would block
+        int try_send_to(const Address& addr, const uint8_t* buf, int sz)
         {
             if(not m_bOpen)
                 throw socket_exception("UDPSocket::send socket not open");
@@ -467,7 +600,7 @@ class UDPSocket:
                     );
                 if(n==SOCKET_ERROR){
                     if(errno == EWOULDBLOCK || errno == EAGAIN)
-                        throw kit::yield_exception();
+                        break;
                     else
                         throw socket_exception(
                             std::string("UDPSocket::send socket error (")+
@@ -477,9 +610,17 @@ class UDPSocket:
                 sent += n;
                 left -= n;
             }
-
+            return sent;
         }
+        // see send_to()
         virtual void send(const uint8_t* buf, int sz) override
+        {
+            if(try_send(buf, sz) == 0)
+                throw kit::yield_exception();
+        }
+        // Non-throwing version of send()
+        // returns the number of bytes sent, 0 if it would block
+        int try_send(const uint8_t* buf, int sz)
         {
             if(not m_bOpen)
                 throw socket_exception("UDPSocket::send socket not open");
@@ -491,7 +632,7 @@ class UDPSocket:
                 n = ::send(m_Socket, (char*)(buf + sent), left, 0);
                 if(n==SOCKET_ERROR){
                     if(errno == EWOULDBLOCK || errno == EAGAIN)
-                        throw kit::yield_exception();
+                        break;
                     else
                         throw socket_exception(
                             std::string("UDPSocket::send socket error (")+
@@ -501,11 +642,20 @@ class UDPSocket:
                 sent += n;
                 left -= n;
             }
+            return sent;
         }
         virtual void send(std::string buf) override {
             send((const uint8_t*)buf.c_str(), (int)buf.size());
         }
         int recv_from(Address& addr, uint8_t* buf, int sz) {
+            int n = try_recv_from(addr, buf, sz);
+            if(n == 0)
+                throw kit::yield_exception();
+            return n;
+        }
+        // Non-throwing version of recv_from()
+        // returns 0 if nothing is available yet
+        int try_recv_from(Address& addr, uint8_t* buf, int sz) {
             if(sz <= 0)
                 throw socket_exception("UDPSocket::recv buffer has no space");
             if(not m_bOpen)
@@ -519,7 +669,7 @@ class UDPSocket:
                 );
             if(n == SOCKET_ERROR){
                 if(errno == EWOULDBLOCK || errno == EAGAIN)
-                    throw kit::yield_exception();
+                    return 0;
                 else
                     throw socket_exception(
                         std::string("UDPSocket::recv socket error (")+
@@ -536,6 +686,14 @@ class UDPSocket:
         }
 
         virtual int recv(uint8_t* buf, int sz) override {
+            int n = try_recv(buf, sz);
+            if(n == 0)
+                throw kit::yield_exception();
+            return n;
+        }
+        // Non-throwing version of recv()
+        // returns 0 if nothing is available yet
+        int try_recv(uint8_t* buf, int sz) {
             if(sz <= 0)
                 throw socket_exception("UDPSocket::recv buffer has no space");
             if(not m_bOpen)
@@ -544,7 +702,7 @@ class UDPSocket:
             n = ::recv(m_Socket, (char*)buf, sz, 0);
             if(n == SOCKET_ERROR){
                 if(errno == EWOULDBLOCK || errno == EAGAIN)
-                    throw kit::yield_exception();
+                    return 0;
                 else
                     throw socket_exception(
                         std::string("UDPSocket::recv socket error (")+
@@ -565,6 +723,13 @@ class UDPSocket:
             buf[r] = '\0';
             return std::string((char*)buf, r);
         }
+        boost::optional<std::string> try_recv() {
+            uint8_t buf[1024];
+            int r = try_recv(buf, sizeof(buf) - 1);
+            if(r == 0)
+                return boost::none;
+            return std::string((char*)buf, r);
+        }
         
     protected:
         
@@ -5,7 +5,11 @@
 //#include "../include/kit/async/task.h"
 //#include "../include/kit/async/channel.h"
 //#include "../include/kit/async/multiplexer.h"
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <numeric>
+#include <set>
 #include <vector>
 #include <boost/thread.hpp>
 #include <boost/chrono.hpp>
@@ -38,6 +42,60 @@ TEST_CASE("Task","[task]") {
         REQUIRE_NOTHROW(task(false));
         REQUIRE(kit::ready(fut));
     }
+    SECTION("polling tasks"){
+        Task<int(bool)> task([](bool err){
+            if(err)
+                YIELD();
+            return 42;
+        });
+        auto fut = task.get_future();
+        
+        REQUIRE(not task.poll(true));
+        REQUIRE(not kit::ready(fut));
+        
+        REQUIRE(task.poll(false));
+        REQUIRE(fut.get() == 42);
+    }
+    SECTION("small buffer storage"){
+        char small[TASK_BUFFER / 2] = {1};
+        char big[TASK_BUFFER * 2] = {2};
+        kit::small_function<int(), TASK_BUFFER> f([small]{
+            return int(small[0]);
+        });
+        REQUIRE(f.local());
+        REQUIRE(f() == 1);
+        kit::small_function<int(), TASK_BUFFER> g([big]{
+            return int(big[0]);
+        });
+        REQUIRE(not g.local());
+        REQUIRE(g() == 2);
+        f = std::move(g);
+        REQUIRE(not g);
+        REQUIRE(f() == 2);
+        REQUIRE(not kit::small_function<void()>(std::function<void()>()));
+        
+        // move-only callables
+        Task<int()> task([]{ return 3; });
+        auto fut = task.get_future();
+        kit::small_function<void()> h(std::move(task));
+        h();
+        REQUIRE(fut.get() == 3);
+    }
+    SECTION("detached tasks"){
+        int calls = 0;
+        auto task = Task<int()>::detached([&calls]{
+            ++calls;
+            return 42;
+        });
+        REQUIRE_THROWS_AS(task.get_future(), std::future_error);
+        REQUIRE(task.poll());
+        REQUIRE(calls == 1);
+        
+        auto failing = Task<void()>::detached([]{
+            throw std::runtime_error("dropped");
+        });
+        REQUIRE_NOTHROW(failing());
+    }
 }
 
 TEST_CASE("Channel","[channel]") {
@@ -60,6 +118,39 @@ TEST_CASE("Channel","[channel]") {
         };
         REQUIRE(num == 42);
     }
+    SECTION("non-throwing usage"){
+        Channel<int> chan;
+        chan.buffer(1);
+        REQUIRE(not chan.try_get());
+        REQUIRE(chan.try_send(1));
+        REQUIRE(not chan.try_send(2)); // full
+        auto cl = chan.lock();
+        int num = 0;
+        REQUIRE(not chan.try_recv(num)); // locked
+        cl.unlock();
+        REQUIRE(chan.try_recv(num));
+        REQUIRE(num == 1);
+        REQUIRE(chan.try_send(3));
+        auto r = chan.try_get();
+        REQUIRE(bool(r));
+        REQUIRE(*r == 3);
+    }
+    SECTION("awaiting without exceptions"){
+        Multiplexer mx;
+        Channel<int> chan;
+        chan.buffer(1);
+        int sum = 0;
+        mx[0].coro<void>([&mx, &chan]{
+            for(int i=1;i<=3;++i)
+                AWAIT_TRY_MX(mx, chan.try_send(i));
+        });
+        mx[1].coro<void>([&mx, &chan, &sum]{
+            for(int i=1;i<=3;++i)
+                sum += *AWAIT_TRY_MX(mx, chan.try_get());
+        });
+        mx.finish();
+        REQUIRE(sum == 6);
+    }
     SECTION("peeking, coroutines, explicit locking"){
         Multiplexer mx;
         auto chan = make_shared<Channel<int>>();
@@ -197,6 +288,127 @@ TEST_CASE("Channel","[channel]") {
         //REQUIRE((in == vector<char>{'4','5'}));
         //REQUIRE((out == vector<char>{'1','2','3'}));
     }
+    SECTION("readiness") {
+        Channel<int> chan;
+        REQUIRE(not chan.ready());
+        REQUIRE(chan.try_send(1));
+        REQUIRE(chan.try_send(2));
+        REQUIRE(chan.ready_count() == 2);
+        REQUIRE(*chan.try_get() == 1);
+        REQUIRE(chan.ready()); // one left
+        REQUIRE(*chan.try_get() == 2);
+        REQUIRE(not chan.ready());
+    }
+    SECTION("parking until ready") {
+        Multiplexer mx(true, 2);
+        auto chan = make_shared<Channel<int>>();
+        auto ring = make_shared<Channel<int, kit::spsc>>(2);
+        chan->buffer(1);
+        const int N = 50;
+        mx[0].coro<void>([&mx, chan, ring]{
+            for(int i=1;i<=N;++i)
+                AWAIT_ON_MX(mx, chan->send_waiters(), *chan << i);
+            for(int i=1;i<=N;++i)
+                AWAIT_ON_MX(mx, ring->send_waiters(), *ring << i);
+        });
+        auto sum = mx[1].coro<int>([&mx, chan, ring]{
+            int sum = 0;
+            for(int i=1;i<=N;++i)
+                sum += AWAIT_ON_MX(mx, chan->recv_waiters(), chan->get());
+            for(int i=1;i<=N;++i)
+                sum += AWAIT_ON_MX(mx, ring->recv_waiters(), ring->get());
+            return sum;
+        });
+        mx.finish();
+        REQUIRE(sum.get() == N * (N+1));
+        // woken by the other side rather than polling, only a notify
+        //   landing right before park() makes a unit run again early
+        uint64_t yields = 0;
+        for(auto&& s: mx.stats())
+            yields += s.yields;
+        REQUIRE(yields < N);
+    }
+    SECTION("bulk transfer") {
+        Channel<int> chan;
+        vector<int> in = {1,2,3};
+        const int* storage = in.data();
+        chan.stream(in);
+        REQUIRE(in.empty());
+        vector<int> out;
+        chan.get(out);
+        REQUIRE(out.data() == storage); // swapped, never copied
+        REQUIRE((out == vector<int>{1,2,3}));
+
+        for(int i=1;i<=5;++i)
+            REQUIRE(chan.try_send(i));
+        REQUIRE(*chan.try_get() == 1);
+        int sum = 0;
+        auto add = [&sum](int* first, int* last) {
+            sum += std::accumulate(first, last, 0);
+        };
+        REQUIRE(chan.consume(add) == 4);
+        REQUIRE(sum == 14);
+        REQUIRE(not chan.ready());
+        REQUIRE(chan.try_consume(add) == 0);
+        REQUIRE_THROWS_AS(chan.consume(add), kit::yield_exception);
+
+        // in place in the ring, in two parts once it wraps around
+        Channel<int, kit::spsc> ring(4);
+        for(int i=1;i<=3;++i)
+            REQUIRE(ring.try_send(i));
+        REQUIRE(*ring.try_get() == 1);
+        REQUIRE(*ring.try_get() == 2);
+        for(int i=4;i<=6;++i)
+            REQUIRE(ring.try_send(i));
+        unsigned calls = 0;
+        vector<int> got;
+        REQUIRE(ring.consume([&](int* first, int* last) {
+            ++calls;
+            got.insert(got.end(), first, last);
+        }) == 4);
+        REQUIRE(calls == 2);
+        REQUIRE((got == vector<int>{3,4,5,6}));
+        REQUIRE(ring.empty());
+    }
+    SECTION("lock-free rings") {
+        Channel<int, kit::spsc> chan(3);
+        REQUIRE(chan.buffered() == 4); // rounded up
+        REQUIRE(not chan.ready());
+        REQUIRE(not chan.try_get());
+        for(int i=0;i<4;++i)
+            REQUIRE(chan.try_send(i));
+        REQUIRE(not chan.try_send(4)); // full
+        REQUIRE(chan.size() == 4);
+        REQUIRE(chan.peek() == 0);
+        int num = -1;
+        REQUIRE(chan.try_recv(num));
+        REQUIRE(num == 0);
+        vector<int> in = {4,5,6};
+        REQUIRE_THROWS_AS(chan.stream(in), kit::yield_exception); // partial
+        REQUIRE((in == vector<int>{5,6}));
+        REQUIRE((chan.get<vector<int>>() == vector<int>{1,2,3,4}));
+        REQUIRE(chan.empty());
+        chan.close();
+        REQUIRE_THROWS_AS(chan << 1, std::runtime_error);
+
+        // several producer circuits feeding one consumer coroutine
+        Multiplexer mx(true, 3);
+        auto many = make_shared<Channel<int, kit::mpsc>>(16);
+        const int N = 1000;
+        for(unsigned c=1;c<=2;++c)
+            mx[c].coro<void>([&mx, many]{
+                for(int i=1;i<=N;++i)
+                    AWAIT_MX(mx, *many << i);
+            });
+        auto sum = mx[0].coro<long>([&mx, many]{
+            long sum = 0;
+            for(int i=0;i<2*N;++i)
+                sum += AWAIT_MX(mx, many->get());
+            return sum;
+        });
+        mx.finish();
+        REQUIRE(sum.get() == long(N) * (N+1));
+    }
 }
 
 //TEST_CASE("TaskQueue","[taskqueue]") {
@@ -302,9 +514,718 @@ TEST_CASE("Multiplexer","[multiplexer]") {
         mx.finish();
         REQUIRE(done);
     }
+    SECTION("work stealing"){
+        Multiplexer mx(true, 4);
+        mx.stealing(true);
+        std::mutex m;
+        std::set<boost::thread::id> threads;
+        std::set<boost::thread::id> pinned_threads;
+        vector<future<void>> futs;
+        for(int i=0;i<32;++i) {
+            // all work starts on the same circuit
+            futs.push_back(mx[0].task<void>([&]{
+                boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+                auto l = std::unique_lock<std::mutex>(m);
+                threads.insert(boost::this_thread::get_id());
+            }));
+            futs.push_back(mx[0].task<void>([&]{
+                boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+                auto l = std::unique_lock<std::mutex>(m);
+                pinned_threads.insert(boost::this_thread::get_id());
+            }, Multiplexer::PINNED));
+        }
+        for(auto&& fut: futs)
+            fut.get();
+        mx.finish();
+        REQUIRE(threads.size() > 1);
+        REQUIRE(pinned_threads.size() == 1);
+    }
+    SECTION("stealing suspended coroutines"){
+        Multiplexer mx(true, 2);
+        mx.stealing(true);
+        std::atomic<bool> started = ATOMIC_VAR_INIT(false);
+        std::atomic<bool> busy = ATOMIC_VAR_INIT(false);
+        auto coro_thread = mx[0].coro<boost::thread::id>([&mx, &started, &busy]{
+            started = true;
+            // circuit 0 gets stuck while we're suspended here,
+            //   so we can only resume somewhere else
+            YIELD_UNTIL_MX(mx, busy);
+            return boost::this_thread::get_id();
+        });
+        while(not started) {}
+        auto busy_thread = mx[0].task<boost::thread::id>([&busy]{
+            busy = true;
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+            return boost::this_thread::get_id();
+        }, Multiplexer::PINNED);
+        REQUIRE(coro_thread.get() != busy_thread.get());
+        mx.finish();
+    }
+    SECTION("batches"){
+        Multiplexer mx(true, 2);
+        vector<std::function<int()>> cbs;
+        for(int i=0;i<100;++i)
+            cbs.push_back([i]{ return i; });
+        auto futs = mx[0].submit_batch<int>(cbs);
+        REQUIRE(futs.size() == 100);
+        for(int i=0;i<100;++i)
+            REQUIRE(futs[i].get() == i);
+        
+        // buffered circuits take the batch a chunk at a time
+        mx[1].buffer(8);
+        std::atomic<int> sum = ATOMIC_VAR_INIT(0);
+        vector<std::function<void()>> work;
+        for(int i=1;i<=100;++i)
+            work.push_back([&sum, i]{ sum += i; });
+        mx[1].submit_batch_all(work).get();
+        REQUIRE(sum == 5050);
+        
+        // first exception wins, after everything has run
+        sum = 0;
+        work.clear();
+        for(int i=0;i<10;++i)
+            work.push_back([&sum]{
+                ++sum;
+                throw std::runtime_error("fail");
+            });
+        REQUIRE_THROWS_AS(mx[1].submit_batch_all(work).get(), std::runtime_error);
+        REQUIRE(sum == 10);
+        REQUIRE_NOTHROW(mx[0].submit_batch_all({}).get());
+        mx.finish();
+    }
+    SECTION("fire and forget"){
+        Multiplexer mx(true, 2);
+        std::atomic<int> done = ATOMIC_VAR_INIT(0);
+        std::atomic<int> errors = ATOMIC_VAR_INIT(0);
+        auto on_error = [&errors](std::exception_ptr e){
+            try{
+                std::rethrow_exception(e);
+            }catch(const std::runtime_error&){
+                ++errors;
+            }
+        };
+        for(int i=0;i<50;++i)
+            mx[0].post([&done]{ ++done; });
+        int retries = 3;
+        mx[0].post([&mx, &done, retries]() mutable {
+            if(--retries)
+                YIELD_MX(mx);
+            ++done;
+        });
+        for(int i=0;i<10;++i)
+            mx[1].spawn_detached([&mx, &done]{
+                YIELD_MX(mx);
+                ++done;
+            });
+        mx.post([]{ throw std::runtime_error("fail"); }, 0, on_error);
+        mx.spawn_detached([&mx]{
+            YIELD_MX(mx);
+            throw std::runtime_error("fail");
+        }, 0, on_error);
+        // no handler: dropped
+        mx[1].post([]{ throw std::runtime_error("fail"); });
+        mx.finish();
+        REQUIRE(done == 61);
+        REQUIRE(errors == 2);
+    }
+    SECTION("backpressure"){
+        Multiplexer mx(true, 2);
+        mx.stealing(false); // keep the full circuit full
+        mx[0].buffer(2);
+        std::atomic<bool> open = ATOMIC_VAR_INIT(false);
+        auto gate = [&open]{
+            while(not open)
+                boost::this_thread::yield();
+        };
+        mx[0].task<void>(gate);
+        mx[0].task<void>(gate);
+        
+        // full
+        REQUIRE(not mx[0].try_task<void>([]{}));
+        auto t0 = std::chrono::steady_clock::now();
+        REQUIRE(not mx[0].try_task_for<void>(std::chrono::milliseconds(10), []{}));
+        REQUIRE(std::chrono::steady_clock::now() - t0 >= std::chrono::milliseconds(10));
+        
+        // blocked producers: a thread and a coroutine on another circuit
+        std::atomic<int> done = ATOMIC_VAR_INIT(0);
+        boost::thread producer([&]{
+            mx[0].task<void>([&done]{ ++done; }).get();
+        });
+        auto coro_producer = mx[1].coro<void>([&]{
+            mx[0].task<void>([&done]{ ++done; });
+        });
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+        REQUIRE(done == 0);
+        
+        open = true;
+        producer.join();
+        coro_producer.get();
+        mx[0].sync();
+        REQUIRE(done == 2);
+        auto fut = mx[0].try_task<int>([]{ return 42; });
+        REQUIRE(bool(fut));
+        REQUIRE(fut->get() == 42);
+        mx.finish();
+    }
+    SECTION("priorities"){
+        Multiplexer mx(true, 1);
+        std::atomic<bool> open = ATOMIC_VAR_INIT(false);
+        mx[0].task<void>([&open]{
+            while(not open)
+                boost::this_thread::yield();
+        });
+        // only touched by the circuit
+        vector<int> order;
+        vector<future<void>> futs;
+        for(int i=0;i<3;++i) {
+            futs.push_back(mx[0].task<void>([&order]{
+                order.push_back(Multiplexer::PRIORITY_BACKGROUND);
+            }, Multiplexer::BACKGROUND));
+            futs.push_back(mx[0].task<void>([&order]{
+                order.push_back(Multiplexer::PRIORITY_NORMAL);
+            }));
+            futs.push_back(mx[0].task<void>([&order]{
+                order.push_back(Multiplexer::PRIORITY_REALTIME);
+            }, Multiplexer::REALTIME));
+        }
+        open = true;
+        for(auto&& fut: futs)
+            fut.get();
+        REQUIRE(std::is_sorted(order.begin(), order.end()));
+        
+        // busy realtime units can't starve background ones
+        std::atomic<bool> queued = ATOMIC_VAR_INIT(false);
+        std::atomic<bool> background = ATOMIC_VAR_INIT(false);
+        auto busy = mx[0].coro<int>([&mx, &queued, &background]{
+            int turns = 0;
+            while(not background) {
+                if(queued)
+                    ++turns;
+                YIELD_MX(mx);
+            }
+            return turns;
+        }, Multiplexer::REALTIME);
+        mx[0].task<void>([&background]{
+            background = true;
+        }, Multiplexer::BACKGROUND);
+        queued = true;
+        REQUIRE(busy.get() <= MX_STARVATION + 1);
+        mx.finish();
+    }
+    SECTION("this_circuit"){
+        Multiplexer mx(true, 2);
+        REQUIRE(not mx.try_this_circuit());
+        REQUIRE_THROWS_AS(mx.this_circuit(), std::out_of_range);
+        for(unsigned i=0;i<2;++i) {
+            auto fut = mx[i].task<Multiplexer::Circuit*>([&mx]{
+                return &mx.this_circuit();
+            });
+            REQUIRE(fut.get() == &mx[i]);
+        }
+        // circuits of another multiplexer aren't ours
+        Multiplexer other(true, 1);
+        auto fut = other[0].task<Multiplexer::Circuit*>([&mx]{
+            return mx.try_this_circuit();
+        });
+        REQUIRE(fut.get() == nullptr);
+        other.finish();
+        mx.finish();
+    }
+    SECTION("stabilized frequency"){
+        Multiplexer mx(true, 1);
+        mx[0].frequency(2000.0f);
+        mx[0].stabilizer(Multiplexer::HYBRID);
+        REQUIRE(mx[0].stabilizer() == Multiplexer::HYBRID);
+        auto t0 = std::chrono::steady_clock::now();
+        mx[0].coro<void>([&mx]{
+            // one tick per yield
+            for(int i=0;i<200;++i)
+                YIELD_MX(mx);
+        }).get();
+        // ticks are never early, how late they are is up to the OS
+        auto elapsed = std::chrono::steady_clock::now() - t0;
+        REQUIRE(elapsed >= std::chrono::milliseconds(95));
+        auto stats = mx[0].tick_stats();
+        REQUIRE(stats.ticks > 0);
+        REQUIRE(stats.frequency > 0.0);
+        mx[0].reset_tick_stats();
+        REQUIRE(mx[0].tick_stats().ticks == 0);
+        mx.finish();
+    }
+    SECTION("stats"){
+        Multiplexer mx(true, 2);
+        mx.stealing(false);
+        mx.timing(true);
+        REQUIRE(mx.timing());
+        for(int i=0;i<10;++i)
+            mx[0].post([]{});
+        mx[0].coro<void>([&mx]{
+            YIELD_MX(mx);
+            YIELD_MX(mx);
+        }).get();
+        mx[1].coro<void>([&mx]{
+            mx.sleep_until(
+                std::chrono::steady_clock::now() + std::chrono::milliseconds(2)
+            );
+        }).get();
+        mx.finish();
+        auto stats = mx.stats();
+        REQUIRE(stats.size() == 2);
+        REQUIRE(stats[0].index == 0);
+        REQUIRE(stats[0].submitted == 11);
+        REQUIRE(stats[0].completed == 11);
+        REQUIRE(stats[0].runs == 13);
+        REQUIRE(stats[0].yields == 2);
+        REQUIRE(stats[0].size == 0);
+        REQUIRE(stats[1].parks == 1);
+        REQUIRE(stats[1].runs == 2);
+        uint64_t timed = 0;
+        for(auto n: stats[0].run_times)
+            timed += n;
+        REQUIRE(timed == stats[0].runs);
+        REQUIRE(stats[0].run_ns > 0);
+    }
+    SECTION("blocking calls"){
+        Multiplexer mx(true, 1);
+        std::atomic<bool> other = ATOMIC_VAR_INIT(false);
+        std::atomic<bool> other_first = ATOMIC_VAR_INIT(false);
+        auto fut = mx[0].coro<int>([&]{
+            return mx.blocking([&]{
+                // the circuit keeps running other units meanwhile
+                while(not other)
+                    boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+                other_first = true;
+                return 42;
+            });
+        });
+        mx[0].task<void>([&other]{ other = true; }).get();
+        REQUIRE(fut.get() == 42);
+        REQUIRE(other_first);
+        
+        auto failing = mx[0].coro<void>([&mx]{
+            mx.blocking([]{ throw std::runtime_error("fail"); });
+        });
+        REQUIRE_THROWS_AS(failing.get(), std::runtime_error);
+        
+        // outside of circuits this just waits
+        REQUIRE(mx.blocking([]{ return 1; }) == 1);
+        mx.finish();
+    }
+    SECTION("time slices"){
+        Multiplexer mx(true, 1);
+        REQUIRE(not mx.maybe_yield()); // not on a circuit
+
+        // no time slice, never yields
+        int yields = 0;
+        mx[0].coro<void>([&mx, &yields]{
+            auto end = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(2);
+            while(std::chrono::steady_clock::now() < end)
+                if(mx.maybe_yield())
+                    ++yields;
+        }).get();
+        REQUIRE(yields == 0);
+
+        mx.time_slice(std::chrono::microseconds(200));
+        REQUIRE(mx.time_slice() == std::chrono::microseconds(200));
+        std::atomic<unsigned> overruns = ATOMIC_VAR_INIT(0);
+        mx.overrun(std::chrono::milliseconds(20),
+            [&overruns](unsigned circuit, std::chrono::nanoseconds d){
+                if(circuit == 0 && d > std::chrono::milliseconds(20))
+                    ++overruns;
+            }
+        );
+        auto t0 = std::chrono::steady_clock::now();
+        mx[0].coro<void>([&mx, &yields]{
+            auto end = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(5);
+            while(std::chrono::steady_clock::now() < end)
+                if(mx.maybe_yield())
+                    ++yields;
+        }).get();
+        // ran past its slice, so it yielded at least once
+        REQUIRE(std::chrono::steady_clock::now() - t0 >=
+            std::chrono::milliseconds(5));
+        REQUIRE(yields > 0);
+        REQUIRE(overruns == 0);
+
+        // tasks would restart from the top, so they don't yield here
+        int runs = 0;
+        bool yielded = false;
+        mx[0].task<void>([&mx, &runs, &yielded]{
+            ++runs;
+            auto end = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(2);
+            while(std::chrono::steady_clock::now() < end)
+                if(mx.maybe_yield())
+                    yielded = true;
+        }).get();
+        REQUIRE(runs == 1);
+        REQUIRE(not yielded);
+
+        // units that never check in overrun
+        mx[0].task<void>([]{
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(30));
+        }).get();
+        mx.finish();
+        REQUIRE(overruns == 1);
+        REQUIRE(mx.stats()[0].overruns == 1);
+    }
+    SECTION("affinity"){
+        auto order = kit::cpu_order();
+        REQUIRE(not order.empty());
+        REQUIRE(kit::cpu_node(order[0]).size() >= 1);
+
+        Multiplexer mx(true, 2);
+        REQUIRE(mx[0].cpus().empty());
+        REQUIRE(mx.affinity(Multiplexer::AFFINITY_CORE) == bool(KIT_AFFINITY));
+        REQUIRE(mx.affinity() == Multiplexer::AFFINITY_CORE);
+        for(unsigned i=0;i<2;++i) {
+            REQUIRE(mx[i].cpus() == vector<unsigned>(1, order[i % order.size()]));
+            #if KIT_AFFINITY
+                auto cpu = mx[i].task<int>([]{ return sched_getcpu(); });
+                REQUIRE(cpu.get() == int(mx[i].cpus()[0]));
+            #endif
+        }
+        mx.affinity(Multiplexer::AFFINITY_NODE);
+        REQUIRE(mx[1].cpus() == kit::cpu_node(order[1 % order.size()]));
+        mx.affinity(Multiplexer::AFFINITY_NONE);
+        REQUIRE(mx[1].cpus().empty());
+        mx.finish();
+    }
+    SECTION("placement"){
+        Multiplexer mx(true, 4);
+        
+        mx.placement(Multiplexer::ROUND_ROBIN);
+        REQUIRE(mx.placement() == Multiplexer::ROUND_ROBIN);
+        std::set<Multiplexer::Circuit*> circuits;
+        for(int i=0;i<4;++i)
+            circuits.insert(&mx.any_circuit());
+        REQUIRE(circuits.size() == 4);
+        
+        // keep every circuit but the last one busy
+        std::atomic<bool> done = ATOMIC_VAR_INIT(false);
+        vector<future<void>> futs;
+        for(unsigned i=0;i<3;++i)
+            futs.push_back(mx[i].task<void>([&done]{
+                while(not done)
+                    boost::this_thread::yield();
+            }));
+        for(unsigned i=0;i<3;++i)
+            REQUIRE(mx[i].load() == 1);
+        REQUIRE(mx[3].load() == 0);
+        
+        mx.placement(Multiplexer::LEAST_QUEUED);
+        for(int i=0;i<8;++i)
+            REQUIRE(&mx.any_circuit() == &mx[3]);
+        // the idle circuit wins whenever it's one of the two picked
+        int idle = 0;
+        for(int i=0;i<64;++i)
+            if(&mx.any_circuit(Multiplexer::POWER_OF_TWO) == &mx[3])
+                ++idle;
+        REQUIRE(idle > 0);
+        
+        done = true;
+        for(auto&& fut: futs)
+            fut.get();
+        mx.finish();
+    }
+}
+
+TEST_CASE("Future","[future]") {
+    SECTION("continuations"){
+        kit::promise<int> p;
+        auto fut = p.get_future().then([](int x){
+            return x * 2;
+        }).then([](int x){
+            return std::to_string(x);
+        });
+        REQUIRE(not fut.ready());
+        p.set_value(21);
+        REQUIRE(fut.ready());
+        REQUIRE(fut.get() == "42");
+        
+        // errors skip the rest of the chain
+        bool called = false;
+        auto failed = kit::make_ready_future(1).then([](int) -> int {
+            throw std::runtime_error("fail");
+        }).then([&called](int x){
+            called = true;
+            return x;
+        });
+        REQUIRE_THROWS_AS(failed.get(), std::runtime_error);
+        REQUIRE(not called);
+        
+        kit::future<int> broken;
+        {
+            kit::promise<int> p2;
+            broken = p2.get_future();
+        }
+        REQUIRE_THROWS_AS(broken.get(), std::future_error);
+    }
+    SECTION("continuations on circuits"){
+        Multiplexer mx(true, 2);
+        Multiplexer::Circuit* first = nullptr;
+        Multiplexer::Circuit* second = nullptr;
+        auto fut = mx[0].async<int>([]{
+            return 1;
+        }).then(mx[1], [&mx, &first](int x){
+            first = mx.try_this_circuit();
+            return x + 1;
+        }).then(mx[0], [&mx, &second](int x){
+            second = mx.try_this_circuit();
+            return x + 1;
+        });
+        REQUIRE(fut.get() == 3);
+        REQUIRE(first == &mx[1]);
+        REQUIRE(second == &mx[0]);
+        
+        auto coro_fut = mx[1].async_coro<int>([&mx]{
+            YIELD_MX(mx);
+            return 7;
+        });
+        REQUIRE(coro_fut.get() == 7);
+        mx.finish();
+    }
+    SECTION("when_all and when_any"){
+        Multiplexer mx(true, 2);
+        vector<kit::future<int>> futs;
+        for(int i=0;i<10;++i)
+            futs.push_back(mx[i].async<int>([i]{ return i; }));
+        auto all = kit::when_all(std::move(futs)).get();
+        REQUIRE(all.size() == 10);
+        for(int i=0;i<10;++i)
+            REQUIRE(all[i] == i);
+        
+        vector<kit::future<void>> voids;
+        std::atomic<int> count = ATOMIC_VAR_INIT(0);
+        for(int i=0;i<10;++i)
+            voids.push_back(mx[i].async<void>([&count]{ ++count; }));
+        kit::when_all(std::move(voids)).get();
+        REQUIRE(count == 10);
+        REQUIRE_NOTHROW(kit::when_all(vector<kit::future<void>>()).get());
+        
+        kit::promise<int> never;
+        vector<kit::future<int>> any;
+        any.push_back(never.get_future());
+        any.push_back(mx[1].async<int>([]{ return 5; }));
+        auto idx = kit::when_any(any).get();
+        REQUIRE(idx == 1);
+        REQUIRE(any[idx].get() == 5);
+        never.set_value(0);
+        vector<kit::future<int>> none;
+        REQUIRE_THROWS_AS(kit::when_any(none).get(), std::invalid_argument);
+        mx.finish();
+    }
+}
+
+TEST_CASE("Parallel","[parallel]") {
+    SECTION("parallel_for"){
+        Multiplexer mx(true, 3);
+        vector<int> v(1000, 0);
+        kit::parallel_for(0, v.size(), [&v](size_t i){
+            v[i] = int(i) * 2;
+        }, 16, mx);
+        bool all = true;
+        for(size_t i=0;i<v.size();++i)
+            all = all && v[i] == int(i) * 2;
+        REQUIRE(all);
+        
+        // empty ranges and default grain
+        kit::parallel_for(5, 5, [](size_t){ throw std::runtime_error("x"); }, 0, mx);
+        std::atomic<int> count = ATOMIC_VAR_INIT(0);
+        kit::parallel_for(10, 20, [&count](size_t){ ++count; }, 0, mx);
+        REQUIRE(count == 10);
+        
+        REQUIRE_THROWS_AS(kit::parallel_for(0, 100, [](size_t i){
+            if(i == 50)
+                throw std::runtime_error("fail");
+        }, 1, mx), std::runtime_error);
+        mx.finish();
+    }
+    SECTION("transform and reduce"){
+        Multiplexer mx(true, 3);
+        vector<int> in(1000);
+        for(size_t i=0;i<in.size();++i)
+            in[i] = int(i);
+        vector<int> out(in.size());
+        auto end = kit::parallel_transform(in.begin(), in.end(), out.begin(),
+            [](int x){ return x + 1; }, 7, mx
+        );
+        REQUIRE(end == out.end());
+        REQUIRE(out[0] == 1);
+        REQUIRE(out[999] == 1000);
+        REQUIRE(kit::parallel_reduce(out.begin(), out.end(), 0,
+            [](int a, int b){ return a + b; }, 7, mx
+        ) == 500500);
+        
+        // combined in order, for ops that aren't commutative
+        vector<string> words{"a","b","c","d","e","f","g"};
+        REQUIRE(kit::parallel_reduce(words.begin(), words.end(), string(">"),
+            [](string a, const string& b){ return a + b; }, 2, mx
+        ) == ">abcdefg");
+        mx.finish();
+    }
+    SECTION("inside coroutines"){
+        Multiplexer mx(true, 2);
+        // every circuit is busy running a parallel_for of its own
+        std::atomic<int> sum = ATOMIC_VAR_INIT(0);
+        vector<std::future<void>> futs;
+        for(unsigned c=0;c<2;++c)
+            futs.push_back(mx[c].coro<void>([&mx, &sum]{
+                kit::parallel_for(0, 100, [&sum](size_t i){
+                    sum += int(i);
+                }, 4, mx);
+            }));
+        futs.push_back(mx[0].task<void>([&mx, &sum]{
+            kit::parallel_for(0, 100, [&sum](size_t i){
+                sum += int(i);
+            }, 4, mx);
+        }));
+        for(auto&& f: futs)
+            f.get();
+        REQUIRE(sum == 3 * 4950);
+        mx.finish();
+    }
 }
 
 TEST_CASE("Coroutines","[coroutines]") {
+    SECTION("Parking on a wait list"){
+        Multiplexer mx;
+        WaitList waiters;
+        std::atomic<bool> ready = ATOMIC_VAR_INIT(false);
+        std::atomic<int> attempts = ATOMIC_VAR_INIT(0);
+        auto check = [&ready, &attempts]{
+            ++attempts;
+            if(not ready)
+                throw kit::yield_exception();
+            return 42;
+        };
+        auto fut = mx[0].coro<int>([&mx, &waiters, &check]{
+            return AWAIT_ON_MX(mx, waiters, check());
+        });
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(LOCK_WAIT_MS));
+        
+        // checked once, then again after registering, then parked
+        REQUIRE(attempts == 2);
+        REQUIRE(not kit::ready(fut));
+        REQUIRE(not mx[0].empty());
+        
+        ready = true;
+        waiters.notify_one();
+        REQUIRE(fut.get() == 42);
+        REQUIRE(attempts == 3);
+        REQUIRE(waiters.empty());
+        mx.finish();
+    }
+    SECTION("Waking many parked coroutines"){
+        Multiplexer mx;
+        WaitList waiters;
+        std::atomic<bool> ready = ATOMIC_VAR_INIT(false);
+        std::atomic<int> done = ATOMIC_VAR_INIT(0);
+        const int N = 256;
+        for(int i=0;i<N;++i)
+            mx[i].coro<void>([&mx, &waiters, &ready, &done]{
+                AWAIT_ON_MX(mx, waiters, ready ? 0 : throw kit::yield_exception());
+                ++done;
+            });
+        ready = true;
+        waiters.notify_all();
+        mx.finish();
+        REQUIRE(done == N);
+    }
+    SECTION("Wait lists outside of coroutines"){
+        Multiplexer mx;
+        WaitList waiters;
+        std::atomic<int> num = ATOMIC_VAR_INIT(0);
+        // plain tasks can't park, so they are polled like AWAIT()
+        auto fut = mx[0].task<int>([&mx, &waiters, &num]{
+            return AWAIT_ON_MX(mx, waiters, num < 3 ? throw kit::yield_exception() : 1);
+        });
+        mx[0].task<void>([&num]{
+            if(++num < 3)
+                YIELD();
+        });
+        REQUIRE(fut.get() == 1);
+        mx.finish();
+    }
+    SECTION("Pooled stacks"){
+        kit::stack_pool pool(64 * 1024);
+        auto alloc = pool.get_allocator();
+        boost::coroutines::stack_context ctx;
+        alloc.allocate(ctx, pool.stack_size());
+        void* sp = ctx.sp;
+        alloc.deallocate(ctx);
+        REQUIRE(pool.cached() == 1);
+        alloc.allocate(ctx, pool.stack_size());
+        REQUIRE(ctx.sp == sp); // reused
+        REQUIRE(pool.cached() == 0);
+        alloc.deallocate(ctx);
+        
+        Multiplexer mx;
+        mx.stack_size(64 * 1024);
+        REQUIRE(mx.stack_size() == 64 * 1024);
+        int sum = 0;
+        for(int i=0;i<100;++i)
+            sum += mx[0].coro<int>([&mx, i]{
+                YIELD_MX(mx);
+                return i;
+            }).get();
+        REQUIRE(sum == 4950);
+        mx.finish();
+    }
+    SECTION("Sleeping"){
+        Multiplexer mx;
+        std::atomic<int> steps = ATOMIC_VAR_INIT(0);
+        auto t0 = chrono::steady_clock::now();
+        auto fut = mx[0].coro<void>([&mx, &steps]{
+            ++steps;
+            mx.sleep_for(chrono::milliseconds(50));
+            ++steps;
+        });
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(LOCK_WAIT_MS));
+        REQUIRE(steps == 1); // parked, not polled
+        REQUIRE(not mx[0].empty());
+        fut.get();
+        REQUIRE(steps == 2);
+        REQUIRE(chrono::steady_clock::now() - t0 >= chrono::milliseconds(50));
+        mx.finish();
+    }
+    SECTION("Timers"){
+        Multiplexer mx;
+        vector<int> order;
+        const int N = 8;
+        vector<future<void>> futs;
+        auto t0 = chrono::steady_clock::now();
+        for(int i=N-1;i>=0;--i)
+            futs.push_back(mx[0].when_at<void>(
+                t0 + chrono::milliseconds(5 * (i+1)), [&order, i]{
+                    order.push_back(i);
+                }
+            ));
+        for(auto&& fut: futs)
+            fut.get();
+        REQUIRE(order.size() == N);
+        REQUIRE(std::is_sorted(order.begin(), order.end()));
+        
+        // spread over enough ticks to move between wheel levels
+        std::atomic<int> early = ATOMIC_VAR_INIT(0);
+        std::atomic<int> done = ATOMIC_VAR_INIT(0);
+        const int M = 10000;
+        t0 = chrono::steady_clock::now();
+        for(int i=0;i<M;++i) {
+            auto deadline = t0 + chrono::milliseconds(std::rand() % 300);
+            mx[i].when_at<void>(deadline, [deadline, &early, &done]{
+                if(chrono::steady_clock::now() < deadline)
+                    ++early;
+                ++done;
+            });
+        }
+        mx.finish();
+        REQUIRE(done == M);
+        REQUIRE(early == 0);
+    }
+
     SECTION("Interleaved"){
         // In most apps, we'd use the singleton multiplexer "MX"
         //   and use AWAIT() instead of AWAIT_MX(mx, ...)
@@ -425,6 +1346,70 @@ TEST_CASE("Coroutines","[coroutines]") {
         mx.stop();
         REQUIRE(done == true);
     }
+    SECTION("Cancelling task groups"){
+        Multiplexer mx(true, 2);
+        Multiplexer::TaskGroup group;
+        WaitList never;
+        std::atomic<int> unwound = ATOMIC_VAR_INIT(0);
+        std::atomic<int> started = ATOMIC_VAR_INIT(0);
+        struct Guard {
+            Guard(std::atomic<int>& started, std::atomic<int>& unwound):
+                n(&unwound)
+            {
+                ++started;
+            }
+            ~Guard() { ++*n; }
+            std::atomic<int>* n;
+        };
+        auto forever = []() -> bool { throw kit::yield_exception(); };
+        std::future<void> parked, looping;
+        {
+            Multiplexer::TaskGroup::Scope scope(group);
+            // parked forever
+            parked = mx[0].coro<void>([&, forever]{
+                Guard g(started, unwound);
+                // spawned from inside the group, so it joins too
+                mx[1].coro<void>([&, forever]{
+                    Guard g(started, unwound);
+                    AWAIT_ON_MX(mx, never, forever());
+                });
+                AWAIT_ON_MX(mx, never, forever());
+            });
+            // yields forever
+            looping = mx[1].coro<void>([&]{
+                Guard g(started, unwound);
+                // either stops here or is destroyed while yielding
+                while(not mx.cancelled())
+                    YIELD_MX(mx);
+            });
+        }
+        // not part of the group
+        auto other = mx[0].coro<void>([&mx]{
+            mx.sleep_until(std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(5));
+        });
+        while(started < 3)
+            boost::this_thread::yield();
+        REQUIRE(group.size() == 3);
+        REQUIRE(not group.cancelled());
+        group.cancel();
+        group.wait();
+        REQUIRE(group.empty());
+        REQUIRE(unwound == 3);
+        REQUIRE_THROWS_AS(parked.get(), std::future_error);
+        looping.wait();
+        REQUIRE_NOTHROW(other.get());
+        
+        // units added to a cancelled group never run
+        bool ran = false;
+        {
+            Multiplexer::TaskGroup::Scope scope(group);
+            mx[0].post([&ran]{ ran = true; });
+        }
+        group.wait();
+        mx.finish();
+        REQUIRE(not ran);
+    }
 }
 
 TEST_CASE("async_wrap","[async_wrap]") {
@@ -467,6 +1452,45 @@ TEST_CASE("async_fstream","[async_fstream]") {
 
             // failed opens still store file name
             REQUIRE(not file.filename().get().empty());
+            
+            // queued operations run in order
+            file.open(fn);
+            auto open = file.is_open();
+            auto buf = file.buffer();
+            file.close();
+            auto name = file.filename();
+            REQUIRE(open.get());
+            REQUIRE(buf.get() == "test\n");
+            REQUIRE(name.get() == "");
+        }
+        mx.finish();
+    }
+    SECTION("cancelled operations give up their turn"){
+        Multiplexer mx;
+        {
+            async_fstream file(&mx[0]);
+            atomic<bool> hold = ATOMIC_VAR_INIT(true);
+            auto busy = file.with<bool>([&](fstream&){
+                while(hold)
+                    boost::this_thread::yield();
+                return true;
+            });
+            
+            // queued behind busy, then dropped before its turn
+            Multiplexer::TaskGroup group;
+            {
+                Multiplexer::TaskGroup::Scope scope(group);
+                file.filename();
+            }
+            group.cancel();
+            group.wait(mx);
+            
+            auto later = file.is_open();
+            hold = false;
+            REQUIRE(busy.get());
+            REQUIRE(later.wait_for(std::chrono::seconds(5)) ==
+                std::future_status::ready);
+            REQUIRE(not later.get());
         }
         mx.finish();
     }
@@ -1,6 +1,8 @@
 #include <catch.hpp>
 #include "../kit/net/net.h"
+#include <atomic>
 #include <string>
+#include <fcntl.h>
 using namespace std;
 
 TEST_CASE("Socket","[socket]") {
@@ -62,6 +64,125 @@ TEST_CASE("Socket","[socket]") {
     }
     SECTION("udp client"){
     }
+    SECTION("waiting on the reactor"){
+        int fds[2];
+        REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        for(int fd: fds)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        TCPSocket a(fds[0]), b(fds[1]);
+        
+        Multiplexer mx;
+        atomic<int> attempts = ATOMIC_VAR_INIT(0);
+        auto fut = mx[0].coro<string>([&]{
+            return AWAIT_IO_MX(mx, b.socket(), Multiplexer::READ,
+                (++attempts, b.recv())
+            );
+        });
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+        REQUIRE(attempts == 1); // parked, not polled
+        
+        a.send("hello world!");
+        REQUIRE(fut.get() == "hello world!");
+        REQUIRE(attempts == 2);
+        mx.finish();
+    }
+    SECTION("dropping waiters that gave up"){
+        int fds[2];
+        REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        for(int fd: fds)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        TCPSocket a(fds[0]), b(fds[1]);
+        
+        kit::reactor<int> r;
+        REQUIRE(r.add(b.socket(), kit::reactor<int>::READ, 1));
+        REQUIRE(r.add(b.socket(), kit::reactor<int>::READ |
+            kit::reactor<int>::WRITE, 2));
+        REQUIRE(r.size() == 3);
+        r.prune([](int& v){ return v == 2; });
+        REQUIRE(r.size() == 1);
+        r.prune([](int&){ return true; });
+        REQUIRE(r.empty());
+        
+        // a coroutine cancelled while waiting on a socket that then closes
+        Multiplexer mx(true, 1);
+        Multiplexer::TaskGroup group;
+        atomic<bool> started = ATOMIC_VAR_INIT(false);
+        {
+            Multiplexer::TaskGroup::Scope scope(group);
+            mx[0].coro<void>([&]{
+                started = true;
+                AWAIT_IO_MX(mx, b.socket(), Multiplexer::READ, b.recv());
+            });
+        }
+        while(not started)
+            boost::this_thread::yield();
+        group.cancel();
+        group.wait(mx);
+        b.close();
+        
+        // the circuit still waits on other sockets
+        int more[2];
+        REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, more) == 0);
+        for(int fd: more)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        TCPSocket c(more[0]), d(more[1]);
+        auto fut = mx[0].coro<string>([&]{
+            return AWAIT_IO_MX(mx, d.socket(), Multiplexer::READ, d.recv());
+        });
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+        c.send("still here");
+        REQUIRE(fut.get() == "still here");
+        mx.finish();
+    }
+    SECTION("sending whole messages"){
+        int fds[2];
+        REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        for(int fd: fds)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        TCPSocket a(fds[0]), b(fds[1]);
+        
+        // both bigger than the socket buffer
+        auto message = [](char tag){
+            string msg(1 << 19, tag);
+            for(size_t i=0;i<msg.size();i+=7)
+                msg[i] = char(i % 251);
+            return msg;
+        };
+        string first = message('a'), second = message('b');
+        string got;
+        uint8_t buf[4096];
+        auto drain_until = [&](size_t sz){
+            while(got.size() < sz){
+                if(int n = b.try_recv(buf, sizeof(buf)))
+                    got.append((char*)buf, n);
+                else
+                    boost::this_thread::yield();
+            }
+        };
+        
+        Multiplexer mx(true, 1);
+        auto fut = mx[0].coro<void>([&]{
+            a.send_all(first, mx);
+        });
+        drain_until(first.size());
+        fut.get();
+        REQUIRE(got == first);
+        
+        // concurrent senders on one socket take turns
+        got.clear();
+        auto fut1 = mx[0].coro<void>([&]{
+            a.send_all(first, mx);
+        });
+        auto fut2 = mx[0].coro<void>([&]{
+            a.send_all(second, mx);
+        });
+        drain_until(first.size() + second.size());
+        fut1.get();
+        fut2.get();
+        REQUIRE(got.size() == first.size() + second.size());
+        REQUIRE((got == first + second || got == second + first));
+        mx.finish();
+    }
     SECTION("addresses"){
         Address addr;
         
@@ -65,3 +65,18 @@ solution("kit")
         kind("ConsoleApp")
         files { "src/chat.cpp" }
 
+    project("bench_queue")
+        kind("ConsoleApp")
+        files { "src/bench_queue.cpp" }
+
+    project("bench_yield")
+        kind("ConsoleApp")
+        files { "src/bench_yield.cpp" }
+
+    project("bench_spawn")
+        kind("ConsoleApp")
+        files { "src/bench_spawn.cpp" }
+
+    project("bench_batch")
+        kind("ConsoleApp")
+        files { "src/bench_batch.cpp" }
@@ -0,0 +1,56 @@
+#include "../../kit/async/async.h"
+#include <iostream>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+using namespace std;
+
+// Measures fanning out lots of tiny tasks to one circuit (tasks/second),
+//   one task() at a time vs. submit_batch() and submit_batch_all()
+//
+// usage: bench_batch [tasks per run]
+
+template<class Func>
+void run(const char* name, unsigned count, Func func)
+{
+    auto t0 = chrono::steady_clock::now();
+    func(count);
+    auto t1 = chrono::steady_clock::now();
+    
+    double sec = chrono::duration<double>(t1 - t0).count();
+    cout << name << ": " << unsigned(count / sec) << " tasks/sec" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned count = 10000;
+    try{
+        if(argc > 1)
+            count = boost::lexical_cast<unsigned>(argv[1]);
+    }catch(...){}
+    
+    atomic<unsigned> sum = ATOMIC_VAR_INIT(0);
+    auto job = [&sum]{ ++sum; };
+    
+    run("task()", count, [&](unsigned n){
+        vector<future<void>> futs;
+        futs.reserve(n);
+        for(unsigned i=0;i<n;++i)
+            futs.push_back(MX[0].task<void>(job));
+        for(auto&& fut: futs)
+            fut.get();
+    });
+    run("submit_batch()", count, [&](unsigned n){
+        for(auto&& fut: MX[0].submit_batch<void>(
+            vector<function<void()>>(n, job)
+        ))
+            fut.get();
+    });
+    run("submit_batch_all()", count, [&](unsigned n){
+        MX[0].submit_batch_all(vector<function<void()>>(n, job)).get();
+    });
+    
+    MX.finish();
+    return 0;
+}
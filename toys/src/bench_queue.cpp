@@ -0,0 +1,50 @@
+#include "../../kit/async/async.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+using namespace std;
+
+// Measures how fast tasks can be pushed into a single circuit by
+//   1, 4 and 16 producer threads at once (tasks/second)
+//
+// usage: bench_queue [tasks per run]
+
+int main(int argc, char** argv)
+{
+    unsigned total = 200000;
+    try{
+        if(argc > 1)
+            total = boost::lexical_cast<unsigned>(argv[1]);
+    }catch(...){}
+    
+    for(unsigned producers: {1U, 4U, 16U})
+    {
+        std::atomic<unsigned> done = ATOMIC_VAR_INIT(0);
+        const unsigned per_thread = total / producers;
+        const unsigned count = per_thread * producers;
+        
+        auto t0 = chrono::steady_clock::now();
+        vector<thread> threads;
+        for(unsigned i=0;i<producers;++i)
+            threads.emplace_back([&done, per_thread]{
+                for(unsigned j=0;j<per_thread;++j)
+                    MX[0].task<void>([&done]{
+                        ++done;
+                    });
+            });
+        for(auto&& t: threads)
+            t.join();
+        while(done < count)
+            this_thread::yield();
+        auto t1 = chrono::steady_clock::now();
+        
+        double sec = chrono::duration<double>(t1 - t0).count();
+        cout << producers << " producer(s): "
+             << unsigned(count / sec) << " tasks/sec" << endl;
+    }
+    
+    MX.finish();
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include "../../kit/async/async.h"
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+using namespace std;
+
+// Measures how fast short-lived coroutines can be spawned and torn down
+//   on one circuit (coroutines/second), in batches so stacks get reused
+//
+// usage: bench_spawn [coroutines per run]
+
+int main(int argc, char** argv)
+{
+    unsigned total = 100000;
+    try{
+        if(argc > 1)
+            total = boost::lexical_cast<unsigned>(argv[1]);
+    }catch(...){}
+    
+    const unsigned batch = 1000;
+    for(bool yield: {false, true})
+    {
+        auto t0 = chrono::steady_clock::now();
+        for(unsigned i=0;i<total;i+=batch)
+        {
+            vector<future<void>> futs;
+            futs.reserve(batch);
+            for(unsigned j=0;j<batch;++j)
+                futs.push_back(MX[0].coro<void>([yield]{
+                    if(yield)
+                        YIELD();
+                }));
+            for(auto&& fut: futs)
+                fut.get();
+        }
+        auto t1 = chrono::steady_clock::now();
+        
+        double sec = chrono::duration<double>(t1 - t0).count();
+        cout << (yield ? "spawn, yield once: " : "spawn: ")
+             << unsigned(total / sec) << " coroutines/sec" << endl;
+    }
+    
+    MX.finish();
+    return 0;
+}
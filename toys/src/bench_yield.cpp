@@ -0,0 +1,80 @@
+#include "../../kit/async/async.h"
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+using namespace std;
+
+// Measures the cost of one yield round-trip through a circuit (ns/yield)
+//   for a task that yields by throwing kit::yield_exception and for a
+//   coroutine that yields without throwing, then the total yields/sec
+//   with one coroutine yielding on every circuit
+//
+// usage: bench_yield [yields per run]
+
+template<class Func>
+void run(const char* name, unsigned count, Func spawn)
+{
+    auto t0 = chrono::steady_clock::now();
+    spawn(count).get();
+    auto t1 = chrono::steady_clock::now();
+    
+    double ns = chrono::duration<double, nano>(t1 - t0).count();
+    cout << name << ": " << unsigned(ns / count) << " ns/yield" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned count = 1000000;
+    try{
+        if(argc > 1)
+            count = boost::lexical_cast<unsigned>(argv[1]);
+    }catch(...){}
+    
+    run("task (throwing)", count, [](unsigned n){
+        auto left = make_shared<unsigned>(n);
+        return MX[0].task<void>([left]{
+            if(--*left)
+                YIELD();
+        });
+    });
+    run("coroutine (non-throwing)", count, [](unsigned n){
+        return MX[0].coro<void>([n]{
+            for(unsigned i=1;i<n;++i)
+                YIELD();
+        });
+    });
+    run("coroutine AWAIT (throwing)", count, [](unsigned n){
+        auto left = make_shared<unsigned>(n);
+        return MX[0].coro<void>([left]{
+            AWAIT(--*left ? throw kit::yield_exception() : true);
+        });
+    });
+    run("coroutine AWAIT_TRY (non-throwing)", count, [](unsigned n){
+        auto left = make_shared<unsigned>(n);
+        return MX[0].coro<void>([left]{
+            AWAIT_TRY(--*left == 0);
+        });
+    });
+    
+    
+    // every circuit yielding at once, to show yields don't contend
+    //   with each other
+    const unsigned circuits = MX.size();
+    auto t0 = chrono::steady_clock::now();
+    vector<future<void>> futs;
+    for(unsigned c=0;c<circuits;++c)
+        futs.push_back(MX[c].coro<void>([count]{
+            for(unsigned i=1;i<count;++i)
+                YIELD();
+        }));
+    for(auto&& fut: futs)
+        fut.get();
+    auto t1 = chrono::steady_clock::now();
+    double sec = chrono::duration<double>(t1 - t0).count();
+    cout << "coroutines on all " << circuits << " circuits: " <<
+        unsigned(double(count) * circuits / sec) << " yields/sec" << endl;
+    
+    MX.finish();
+    return 0;
+}
@@ -14,6 +14,7 @@ using namespace std;
 //   - TCP-based
 //   - Async
 //   - single strand/circuit for simplicity (hence no added locks/atomics)
+//     so coroutines are PINNED to MX[0] in case work stealing is enabled
 
 struct Client
 {
@@ -34,7 +35,7 @@ void broadcast(std::string text, vector<shared_ptr<Client>> clients)
 {
     LOG(text);
     for(auto&& client: clients)
-        AWAIT(client->socket->send(text + "\n"));
+        client->socket->send_all(text + "\n");
 }
 
 int main(int argc, char** argv)
@@ -55,8 +56,10 @@ int main(int argc, char** argv)
     auto fut = MX[0].coro<void>([&]{
         for(;;)
         {
-            auto socket = make_shared<TCPSocket>(AWAIT(server->accept()));
-            MX[0].coro<void>([&, socket]{
+            auto socket = make_shared<TCPSocket>(
+                AWAIT_READ(server->socket(), server->accept())
+            );
+            MX[0].spawn_detached([&, socket]{
 
                 // add this client
                 auto client = make_shared<Client>(socket);
@@ -66,7 +69,7 @@ int main(int argc, char** argv)
                     for(;;)
                     {
                         // recv message from client
-                        auto msg = AWAIT(socket->recv());
+                        auto msg = AWAIT_READ(socket->socket(), socket->recv());
 
                         boost::algorithm::trim(msg);
 
@@ -84,9 +87,9 @@ int main(int argc, char** argv)
                     if(not client->name.empty())
                         LOGf("%s disconnected (%s)", client->name % e.what());
                 }
-            });
+            }, Multiplexer::PINNED);
         }
-    });
+    }, Multiplexer::PINNED);
     
     fut.get();
     return 0;
@@ -24,13 +24,18 @@ int main(int argc, char** argv)
         for(;;)
         {
             LOG("awaiting connection");
-            auto client = make_shared<TCPSocket>(AWAIT(server->accept()));
-            MX[0].coro<void>([&, client]{
+            auto client = make_shared<TCPSocket>(
+                AWAIT_READ(server->socket(), server->accept())
+            );
+            MX[0].spawn_detached([&, client]{
                 int client_id = client_ids++;
                 LOGf("client %s connected", client_id);
                 try{
                     for(;;)
-                        AWAIT(client->send(AWAIT(client->recv())));
+                    {
+                        auto msg = AWAIT_READ(client->socket(), client->recv());
+                        client->send_all(msg);
+                    }
                 }catch(const socket_exception& e){
                     LOGf("client %s disconnected (%s)", client_id % e.what());
                 }
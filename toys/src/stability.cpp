@@ -12,7 +12,7 @@ int main(int argc, char** argv)
     for(unsigned i=0;i<10;++i)
     {
         auto c = rand() % MX.size();
-        MX[c].coro<void>([i,c]{
+        MX[c].spawn_detached([i,c]{
             for(;;){
                 YIELD();
             }